@@ -0,0 +1,176 @@
+// Measures how long it takes to allocate states from memory contexts, with the same pattern as loading
+// them: every file is pushed to the section's vector, which is grown in the context, and gets its line table
+// and hunks when it is unfolded. The bump allocator of `ctxt_alloc` is compared with the allocator it has
+// replaced, which searched the regions from the first one for free space on every allocation and doubled
+// the size of every new region.
+#define _POSIX_C_SOURCE 200809L
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ctxt.h"
+#include "error.h"
+#include "git/state.h"
+#include "vector.h"
+
+#define HUNKS_PER_FILE 4
+#define LINES_PER_HUNK 5
+#define RUNS 5
+// Allocations made by the loads of each file count
+#define ALLOCATIONS 3000000
+
+static const size_t FILE_COUNTS[] = {1000, 10000, 100000};
+
+// Previous allocator, as it was before the context got the current region
+
+#define SCAN_INITIAL_REGION_SIZE 4096
+#define SCAN_REGION_SIZE_MULTIPLIER 2
+
+#define MAX(a, b) ((a) < (b) ? (b) : (a))
+
+typedef struct _ScanRegion {
+    struct _ScanRegion *next;
+    size_t capacity;
+    size_t used;
+    char buffer[];
+} ScanRegion;
+
+typedef struct {
+    ScanRegion *tail;
+    ScanRegion *head;
+} ScanContext;
+
+static ScanRegion *scan_new_region(ScanContext *ctxt, size_t min_size) {
+    ASSERT(ctxt != NULL);
+
+    size_t size = ctxt->head == NULL ? MAX(SCAN_INITIAL_REGION_SIZE, min_size * SCAN_REGION_SIZE_MULTIPLIER)
+                                     : MAX(ctxt->head->capacity, min_size) * SCAN_REGION_SIZE_MULTIPLIER;
+    ScanRegion *region = (ScanRegion *) malloc(sizeof(ScanRegion) + size);
+    if (region == NULL) OUT_OF_MEMORY();
+    *region = (ScanRegion){NULL, size, 0};
+
+    if (ctxt->head == NULL) ctxt->tail = region;
+    else ctxt->head->next = region;
+    ctxt->head = region;
+    return region;
+}
+
+static void *scan_alloc(void *_ctxt, size_t requested_size) {
+    ScanContext *ctxt = (ScanContext *) _ctxt;
+    ASSERT(ctxt != NULL && requested_size != 0);
+
+    size_t size = requested_size + sizeof(void *);
+
+    ScanRegion *current = ctxt->tail;
+    while (current != NULL && current->used + size > current->capacity) current = current->next;
+    if (current == NULL) current = scan_new_region(ctxt, size);
+
+    size_t alignment = sizeof(void *) - (current->used % sizeof(void *));
+    char *ptr = current->buffer + current->used + alignment;
+    current->used += size;
+    return ptr;
+}
+
+static void scan_free(ScanContext *ctxt) {
+    ASSERT(ctxt != NULL);
+
+    for (ScanRegion *current = ctxt->tail, *next = NULL; current != NULL; current = next) {
+        next = current->next;
+        free(current);
+    }
+    *ctxt = (ScanContext){0};
+}
+
+static void *bump_alloc(void *ctxt, size_t size) { return ctxt_alloc((MemoryContext *) ctxt, size); }
+
+typedef void *alloc_t(void *ctxt, size_t size);
+
+// Allocates files of a section like loading a state does, returns the number of allocations.
+static size_t load_files(alloc_t *alloc, void *ctxt, size_t count) {
+    size_t allocations = 0;
+
+    FileVec files = {0};
+    for (size_t i = 0; i < count; i++) {
+        // same as CTXT_VECTOR_PUSH
+        if (files.length == files.capacity) {
+            size_t capacity = files.capacity == 0 ? INITIAL_VECTOR_CAPACITY : files.capacity * 2;
+            File *data = (File *) alloc(ctxt, capacity * sizeof(File));
+            if (files.length > 0) memcpy(data, files.data, files.length * sizeof(File));
+            files.data = data;
+            files.capacity = capacity;
+            allocations++;
+        }
+        files.data[files.length++] = (File){0};
+    }
+
+    // as if every file has been unfolded, see `load_hunks`
+    size_t lines_count = HUNKS_PER_FILE * (LINES_PER_HUNK + 1);
+    for (size_t i = 0; i < files.length; i++) {
+        File *file = &files.data[i];
+        file->line_offsets = (uint32_t *) alloc(ctxt, (lines_count + 1) * sizeof(uint32_t));
+        file->line_kinds = (uint8_t *) alloc(ctxt, lines_count * sizeof(uint8_t));
+        file->hunks.data = (Hunk *) alloc(ctxt, HUNKS_PER_FILE * sizeof(Hunk));
+        // the table is written, so that pages are touched like in a real load
+        memset(file->line_kinds, LK_CONTEXT, lines_count);
+        file->line_offsets[lines_count] = 0;
+        allocations += 3;
+    }
+
+    return allocations;
+}
+
+static double elapsed_ns(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+// Returns time per allocation of loading `loads` states, each of which gets a new context that is freed
+// afterwards, like states of consecutive refreshes.
+static double scan_loads(size_t count, size_t loads) {
+    struct timespec start, end;
+    size_t allocations = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < loads; i++) {
+        ScanContext ctxt = {0};
+        allocations += load_files(&scan_alloc, &ctxt, count);
+        scan_free(&ctxt);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return elapsed_ns(&start, &end) / allocations;
+}
+
+static double bump_loads(size_t count, size_t loads) {
+    struct timespec start, end;
+    size_t allocations = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < loads; i++) {
+        MemoryContext ctxt;
+        ctxt_init(&ctxt, MEM_STATE);
+        allocations += load_files(&bump_alloc, &ctxt, count);
+        ctxt_free(&ctxt);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return elapsed_ns(&start, &end) / allocations;
+}
+
+int main(void) {
+    printf("%-8s %8s %16s %16s\n", "files", "loads", "scan (ns/alloc)", "bump (ns/alloc)");
+
+    for (size_t i = 0; i < sizeof(FILE_COUNTS) / sizeof(FILE_COUNTS[0]); i++) {
+        size_t loads = ALLOCATIONS / (FILE_COUNTS[i] * 3);
+        double best_scan = 0, best_bump = 0;
+        for (int run = 0; run < RUNS; run++) {
+            double scan = scan_loads(FILE_COUNTS[i], loads);
+            double bump = bump_loads(FILE_COUNTS[i], loads);
+            if (run == 0 || scan < best_scan) best_scan = scan;
+            if (run == 0 || bump < best_bump) best_bump = bump;
+        }
+        printf("%-8zu %8zu %16.2f %16.2f\n", FILE_COUNTS[i], loads, best_scan, best_bump);
+    }
+
+    return EXIT_SUCCESS;
+}
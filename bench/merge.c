@@ -0,0 +1,99 @@
+// Measures how long it takes to replace a state with a reloaded one, which carries folds and parsed
+// hunks over with `merge_files` and `merge_hunks`. Every old file has its hunks parsed, half of the
+// new files have the same diff (hunks are reused) and the other half has a changed line in every
+// hunk (hunks are parsed again and merged).
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ctxt.h"
+#include "error.h"
+#include "git/diff.h"
+#include "git/git.h"
+#include "git/state.h"
+#include "vector.h"
+
+#define HUNKS_PER_FILE 4
+#define RUNS 5
+
+static const size_t FILE_COUNTS[] = {1000, 10000, 100000};
+
+static void push_file(File *file, void *_state) {
+    State *state = (State *) _state;
+    ASSERT(file != NULL && state != NULL);
+    CTXT_VECTOR_PUSH(&state->ctxt, &state->unstaged.files, *file);
+}
+
+// Returns diff of `count` files, in which hunks of the second half of the files differ if `is_changed`.
+static char *build_diff(size_t count, bool is_changed, size_t *length) {
+    size_t capacity = count * (192 + HUNKS_PER_FILE * 48);
+    char *diff = (char *) malloc(capacity);
+    if (diff == NULL) OUT_OF_MEMORY();
+
+    size_t used = 0;
+    for (size_t i = 0; i < count; i++) {
+        const char *path_fmt = "diff --git a/dir%zu/file%zu.c b/dir%zu/file%zu.c\n--- a/dir%zu/file%zu.c\n+++ b/dir%zu/file%zu.c\n";
+        size_t dir = i % 100;
+        used += snprintf(diff + used, capacity - used, path_fmt, dir, i, dir, i, dir, i, dir, i);
+
+        const char *line = is_changed && i >= count / 2 ? "changed" : "new";
+        for (size_t j = 0; j < HUNKS_PER_FILE; j++) {
+            size_t start = j * 10 + 1;
+            used += snprintf(diff + used, capacity - used, "@@ -%zu,3 +%zu,3 @@\n a\n-old\n+%s\n c\n", start, start, line);
+        }
+        ASSERT(used < capacity);
+    }
+
+    *length = used;
+    return diff;
+}
+
+static void load_state(State *state, size_t count, bool is_changed, bool has_hunks) {
+    *state = (State){0};
+
+    size_t length;
+    char *diff = build_diff(count, is_changed, &length);
+
+    DiffParser parser;
+    diff_parser_init(&parser, &state->unstaged.raw, &push_file, state);
+    diff_parser_feed(diff, length, &parser);
+    diff_parser_finish(&parser);
+    free(diff);
+
+    // as if every file has been unfolded
+    if (has_hunks) {
+        for (size_t i = 0; i < state->unstaged.files.length; i++) load_hunks(&state->unstaged.files.data[i], &state->ctxt);
+    }
+}
+
+static double elapsed_ms(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1e3 + (end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+int main(void) {
+    printf("%-8s %14s\n", "files", "best of 5 (ms)");
+
+    for (size_t i = 0; i < sizeof(FILE_COUNTS) / sizeof(FILE_COUNTS[0]); i++) {
+        double best = 0;
+        for (int run = 0; run < RUNS; run++) {
+            State state, new_state;
+            load_state(&state, FILE_COUNTS[i], false, true);
+            load_state(&new_state, FILE_COUNTS[i], true, false);
+
+            struct timespec start, end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            replace_git_state(&state, &new_state);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+
+            if (state.unstaged.files.length != FILE_COUNTS[i]) ERROR("Files were lost by the merge.\n");
+            free_state(&state);
+
+            double ms = elapsed_ms(&start, &end);
+            if (run == 0 || ms < best) best = ms;
+        }
+        printf("%-8zu %14.2f\n", FILE_COUNTS[i], best);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,67 @@
+// Measures latency of spawning git while the parent holds heaps of different sizes. `gexec` is
+// compared with fork() and exec, whose cost grows with the heap, because fork copies the page tables.
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "error.h"
+#include "git/exec.h"
+
+#define SPAWNS 50
+
+static const size_t HEAP_SIZES_MB[] = {0, 256, 1024, 2048};
+
+static char *const CMD_VERSION[] = {"git", "--version", NULL};
+
+static double now_ms(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1e3 + time.tv_nsec / 1e6;
+}
+
+static void fork_git(void) {
+    pid_t pid = fork();
+    if (pid == -1) ERROR("Unable to fork: %s.\n", strerror(errno));
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd != -1) dup2(null_fd, STDOUT_FILENO);
+        execvp(CMD_VERSION[0], CMD_VERSION);
+        _exit(127);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) == -1) ERROR("Unable to wait for child: %s.\n", strerror(errno));
+}
+
+int main(void) {
+    printf("%-10s %16s %16s\n", "heap (MB)", "gexec (ms)", "fork+exec (ms)");
+
+    for (size_t i = 0; i < sizeof(HEAP_SIZES_MB) / sizeof(HEAP_SIZES_MB[0]); i++) {
+        size_t size = HEAP_SIZES_MB[i] * 1024 * 1024;
+        char *heap = NULL;
+        if (size > 0) {
+            heap = (char *) malloc(size);
+            if (heap == NULL) OUT_OF_MEMORY();
+            // pages have to be touched, otherwise they aren't mapped
+            memset(heap, 1, size);
+        }
+
+        double start = now_ms();
+        for (int j = 0; j < SPAWNS; j++) gexec(CMD_VERSION);
+        double spawn_ms = (now_ms() - start) / SPAWNS;
+
+        start = now_ms();
+        for (int j = 0; j < SPAWNS; j++) fork_git();
+        double fork_ms = (now_ms() - start) / SPAWNS;
+
+        printf("%-10zu %16.3f %16.3f\n", HEAP_SIZES_MB[i], spawn_ms, fork_ms);
+        free(heap);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -8,13 +8,14 @@
 
 // clang-format off
 static const int styles[__LS_SIZE][3] = {
-    //              foreground           background     attribute(man curs_attr)
-    [LS_SECTION]  = {COLOR_WHITE,        COLOR_DEFAULT, A_BOLD},
-    [LS_FILE]     = {COLOR_WHITE,        COLOR_DEFAULT, A_ITALIC},
-    [LS_HUNK]     = {COLOR_BRIGHT_CYAN,  COLOR_DEFAULT, A_NONE},
-    [LS_LINE]     = {COLOR_BRIGHT_WHITE, COLOR_BLACK,   A_NONE},
-    [LS_ADD_LINE] = {COLOR_BRIGHT_GREEN, COLOR_BLACK,   A_NONE},
-    [LS_DEL_LINE] = {COLOR_BRIGHT_RED,   COLOR_BLACK,   A_NONE},
+    //                   foreground           background     attribute(man curs_attr)
+    [LS_SECTION]       = {COLOR_WHITE,         COLOR_DEFAULT, A_BOLD},
+    [LS_FILE]          = {COLOR_WHITE,         COLOR_DEFAULT, A_ITALIC},
+    [LS_HUNK]          = {COLOR_BRIGHT_CYAN,   COLOR_DEFAULT, A_NONE},
+    [LS_LINE]          = {COLOR_BRIGHT_WHITE,  COLOR_BLACK,   A_NONE},
+    [LS_ADD_LINE]      = {COLOR_BRIGHT_GREEN,  COLOR_BLACK,   A_NONE},
+    [LS_DEL_LINE]      = {COLOR_BRIGHT_RED,    COLOR_BLACK,   A_NONE},
+    [LS_RECORDED_LINE] = {COLOR_BRIGHT_YELLOW, COLOR_BLACK,   A_NONE},
 };
 // clang-format on
 
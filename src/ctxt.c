@@ -1,19 +1,29 @@
 #include "ctxt.h"
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "error.h"
 
 #define INITIAL_REGION_SIZE 4096
+#define MAX_REGION_SIZE (1024 * 1024)
 #define REGION_SIZE_MULTIPLIER 2
 
+// Bigger objects are allocated separately, so that regions aren't wasted on them
+#define MAX_REGION_OBJECT_SIZE (MAX_REGION_SIZE / 16)
+
+#define ALIGNMENT alignof(max_align_t)
+#define ALIGN_UP(size) (((size) + ALIGNMENT - 1) & ~(ALIGNMENT - 1))
+
 #define MAX(a, b) ((a) < (b) ? (b) : (a))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
 
-static MemoryRegion *new_region(size_t size) {
-    ASSERT(size > 0);
+static MemoryRegion *new_region(const MemoryContext *ctxt, size_t size) {
+    ASSERT(ctxt != NULL && size > 0);
 
     MemoryRegion *region = (MemoryRegion *) malloc(sizeof(MemoryRegion) + size);
     if (region == NULL) OUT_OF_MEMORY();
+    mem_account(ctxt->category, sizeof(MemoryRegion) + size);
 
     memset(region, 0, sizeof(MemoryRegion));
     region->capacity = size;
@@ -21,57 +31,125 @@ static MemoryRegion *new_region(size_t size) {
     return region;
 }
 
-static MemoryRegion *ctxt_new_region(MemoryContext *ctxt, size_t min_size) {
+static void free_regions(const MemoryContext *ctxt, MemoryRegion *region) {
     ASSERT(ctxt != NULL);
 
-    size_t size = MAX(ctxt->head->capacity, min_size) * REGION_SIZE_MULTIPLIER;
-    MemoryRegion *region = new_region(size);
+    for (MemoryRegion *next = NULL; region != NULL; region = next) {
+        next = region->next;
+        mem_unaccount(ctxt->category, sizeof(MemoryRegion) + region->capacity);
+        free(region);
+    }
+}
+
+static MemoryRegion *ctxt_new_region(MemoryContext *ctxt, size_t min_size) {
+    ASSERT(ctxt != NULL && min_size <= MAX_REGION_SIZE);
+
+    // zeroed context has no regions
+    if (ctxt->head == NULL) {
+        MemoryRegion *region = new_region(ctxt, MAX(INITIAL_REGION_SIZE, min_size));
+        ctxt->tail = region;
+        ctxt->head = region;
+        return region;
+    }
+
+    size_t size = MIN(ctxt->head->capacity * REGION_SIZE_MULTIPLIER, MAX_REGION_SIZE);
+    MemoryRegion *region = new_region(ctxt, MAX(size, min_size));
 
     ctxt->head->next = region;
     ctxt->head = region;
     return region;
 }
 
-void ctxt_init(MemoryContext *ctxt) {
+void ctxt_init(MemoryContext *ctxt, MemoryCategory category) {
     ASSERT(ctxt != NULL);
 
-    MemoryRegion *region = new_region(INITIAL_REGION_SIZE);
-    ctxt->tail = region;
-    ctxt->head = region;
+    *ctxt = (MemoryContext){0};
+    ctxt->category = category;
+    ctxt->current = ctxt_new_region(ctxt, 0);
 }
 
 void ctxt_reset(MemoryContext *ctxt) {
     ASSERT(ctxt != NULL);
 
-    for (MemoryRegion *current = ctxt->tail, *next = NULL; current != NULL; current = next) {
-        next = current->next;
-        current->used = 0;
+    free_regions(ctxt, ctxt->large);
+    ctxt->large = NULL;
+    if (ctxt->tail == NULL) return;
+
+    size_t used = 0;
+    for (MemoryRegion *current = ctxt->tail; current != NULL; current = current->next) used += current->used;
+
+    // the first regions are kept until they are able to hold the same amount
+    MemoryRegion *last = ctxt->tail;
+    size_t kept = last->capacity;
+    last->used = 0;
+    while (last->next != NULL && kept < used) {
+        last = last->next;
+        kept += last->capacity;
+        last->used = 0;
     }
+
+    free_regions(ctxt, last->next);
+    last->next = NULL;
+    ctxt->head = last;
+    ctxt->current = ctxt->tail;
 }
 
 void ctxt_free(MemoryContext *ctxt) {
     ASSERT(ctxt != NULL);
 
-    for (MemoryRegion *current = ctxt->tail, *next = NULL; current != NULL; current = next) {
-        next = current->next;
-        free(current);
+    free_regions(ctxt, ctxt->tail);
+    free_regions(ctxt, ctxt->large);
+    *ctxt = (MemoryContext){ctxt->category, NULL, NULL, NULL, NULL};
+}
+
+void ctxt_merge(MemoryContext *dst, MemoryContext *src) {
+    ASSERT(dst != NULL && src != NULL && dst->category == src->category);
+
+    if (src->tail != NULL) {
+        if (dst->tail == NULL) {
+            dst->tail = src->tail;
+            dst->current = src->current;
+        } else {
+            dst->head->next = src->tail;
+        }
+        dst->head = src->head;
     }
+
+    if (src->large != NULL) {
+        MemoryRegion *last = src->large;
+        while (last->next != NULL) last = last->next;
+        last->next = dst->large;
+        dst->large = src->large;
+    }
+
+    *src = (MemoryContext){src->category, NULL, NULL, NULL, NULL};
+}
+
+static void *ctxt_alloc_large(MemoryContext *ctxt, size_t size) {
+    ASSERT(ctxt != NULL);
+
+    MemoryRegion *region = new_region(ctxt, size);
+    region->used = size;
+    region->next = ctxt->large;
+    ctxt->large = region;
+    return region->buffer;
 }
 
 void *ctxt_alloc(MemoryContext *ctxt, size_t requested_size) {
     ASSERT(ctxt != NULL && requested_size != 0);
+    ASSERT(requested_size <= SIZE_MAX - ALIGNMENT);
 
-    size_t size = requested_size + sizeof(void *);
+    size_t size = ALIGN_UP(requested_size);
+    if (size > MAX_REGION_OBJECT_SIZE) return ctxt_alloc_large(ctxt, size);
 
-    MemoryRegion *current = ctxt->tail;
-    for (MemoryRegion *next = NULL; current != NULL; current = next) {
-        next = current->next;
-        if (current->used + size <= current->capacity) break;
-    }
+    // Regions that can't fit the object are skipped for good, so that allocation takes constant
+    // time. Only the tail of each of them is wasted, because objects are small compared to regions.
+    MemoryRegion *current = ctxt->current;
+    while (current != NULL && current->used + size > current->capacity) current = current->next;
     if (current == NULL) current = ctxt_new_region(ctxt, size);
+    ctxt->current = current;
 
-    size_t alignment = sizeof(void *) - (current->used % sizeof(void *));
-    char *ptr = current->buffer + current->used + alignment;
+    char *ptr = current->buffer + current->used;
     current->used += size;
     return ptr;
 }
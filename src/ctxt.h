@@ -1,24 +1,38 @@
 #ifndef CTXT_H
 #define CTXT_H
 
+#include <stdalign.h>
+#include <stddef.h>
 #include <stdlib.h>
+#include "memstat.h"
 
 typedef struct _MemoryRegion {
     struct _MemoryRegion *next;
     size_t capacity;
     size_t used;
-    char buffer[];
+    alignas(max_align_t) char buffer[];
 } MemoryRegion;
 
+// Arena allocator: objects are bumped from the current region and freed all at once.
+// Zeroed context is valid, it allocates the first region when needed and is accounted as MEM_STATE.
 typedef struct {
+    MemoryCategory category;
     MemoryRegion *tail;
     MemoryRegion *head;
+    MemoryRegion *current;  // allocations are made from it, regions before it are full
+    MemoryRegion *large;    // objects that are too big for regions, each one is allocated separately
 } MemoryContext;
 
-void ctxt_init(MemoryContext *ctxt);
+void ctxt_init(MemoryContext *ctxt, MemoryCategory category);
+// Frees large objects and regions beyond those which were used since the previous reset,
+// the rest are kept for reuse.
 void ctxt_reset(MemoryContext *ctxt);
+// Leaves the context empty
 void ctxt_free(MemoryContext *ctxt);
+// Moves all regions of `src` to `dst`, so that they are freed together, `src` is left empty.
+void ctxt_merge(MemoryContext *dst, MemoryContext *src);
 
+// Returns memory aligned for any type
 void *ctxt_alloc(MemoryContext *ctxt, size_t size);
 
 #endif  // CTXT_H
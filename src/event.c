@@ -7,23 +7,44 @@
 #include <string.h>
 #include <unistd.h>
 #include "error.h"
+#include "git/fetch.h"
 #include "git/git.h"
+#include "git/journal.h"
+#include "git/loader.h"
+#include "git/refresh.h"
+#include "git/renames.h"
+#include "git/repo.h"
+#include "git/staging.h"
 #include "git/state.h"
 #include "ui/ui.h"
 #include "vector.h"
 
-static struct pollfd poll_fds[2];
+// Idle time after which the state updated in place is verified with a full update
+#define VERIFICATION_DELAY_MS 1000
+// Idle time after which the recorded line and hunk operations are applied
+#define JOURNAL_DELAY_MS 500
+
+static struct pollfd poll_fds[7];
 static int events_fd = -1;
-static bool ignore_event = false;
+static bool pending_update = false;
+static char event_buffer[1024];
 
 #ifdef __linux__
 
 #include <sys/inotify.h>
+#include <sys/stat.h>
 
 #define EVENT_MASK (IN_MODIFY | IN_CREATE | IN_DELETE | IN_MOVE | IN_DELETE_SELF | IN_MOVE_SELF)
 
 #define MAX_PATH_LENGTH 4096
 
+static int git_dir_wd = -1;
+
+// Index as it has been left by sagit's own staging commands. Events on the index are only
+// caused by someone else if it has been replaced or modified since.
+static struct stat own_index;
+static bool is_own_index_known = false;
+
 // Recursively adds directories to inotify
 // NOTE: modifies path, which must fit longest possible path.
 static void watch_dir(char *path) {
@@ -58,7 +79,58 @@ static void watch_dir(char *path) {
 static void watch_dirs(void) {
     char path_buffer[MAX_PATH_LENGTH] = ".";
     watch_dir(path_buffer);
-    if (inotify_add_watch(events_fd, ".git", EVENT_MASK) == -1) ERROR("Unable to watch \".git\": %s.\n", strerror(errno));
+    // ".git" may be a gitfile pointing to the actual directory (worktrees, submodules)
+    git_dir_wd = inotify_add_watch(events_fd, repo_git_dir(), EVENT_MASK);
+    if (git_dir_wd == -1) ERROR("Unable to watch \"%s\": %s.\n", repo_git_dir(), strerror(errno));
+}
+
+static bool is_index_event(const struct inotify_event *event) {
+    ASSERT(event != NULL);
+
+    if (event->wd != git_dir_wd || event->len == 0) return false;
+    return strcmp(event->name, "index") == 0 || strcmp(event->name, "index.lock") == 0;
+}
+
+static bool stat_index(struct stat *index) {
+    ASSERT(index != NULL);
+
+    char path[MAX_PATH_LENGTH];
+    if (snprintf(path, sizeof(path), "%s/index", repo_git_dir()) >= (int) sizeof(path)) return false;
+    return stat(path, index) == 0;
+}
+
+static bool is_own_index(void) {
+    struct stat index;
+    if (!is_own_index_known || !stat_index(&index)) return false;
+
+    return index.st_ino == own_index.st_ino && index.st_size == own_index.st_size && index.st_mtim.tv_sec == own_index.st_mtim.tv_sec
+           && index.st_mtim.tv_nsec == own_index.st_mtim.tv_nsec;
+}
+
+// Reads all pending events, returns whether any of them requires an update.
+static bool read_events(bool skip_own) {
+    bool update = false, reindex = false;
+    // queued staging operations are rewriting the index, changed files are diffed once they are finished
+    // and anything else is caught by the verification which follows
+    bool is_index_own = skip_own || staging_pending() > 0 || is_own_index();
+
+    ssize_t bytes;
+    while ((bytes = read(events_fd, event_buffer, sizeof(event_buffer))) > 0) {
+        for (ssize_t i = 0; i < bytes; i += sizeof(struct inotify_event)) {
+            struct inotify_event *event = (struct inotify_event *) (event_buffer + i);
+            i += event->len;
+
+            if (is_index_own && is_index_event(event)) continue;
+            update = true;
+
+            // only new directories need to be watched
+            if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO))) reindex = true;
+        }
+    }
+    if (bytes == -1 && errno != EAGAIN) ERROR("Unable to read inotify event: %s\n", strerror(errno));
+
+    if (reindex) watch_dirs();
+    return update;
 }
 
 #else
@@ -68,6 +140,7 @@ static void watch_dirs(void) {
 #include <sys/types.h>
 #include <sys/wait.h>
 
+static bool ignore_event = false;
 static pid_t watch_thread_pid = -1;
 static int event_write_fd = -1;
 static FSEventStreamRef stream = NULL;
@@ -121,10 +194,6 @@ static void macos_watch_thread(void) {
 #endif
 
 void poll_init(void) {
-    char *root_path = get_git_root_path();
-    if (chdir(root_path) == -1) ERROR("Unable to cd into \"%s\": %s.\n", root_path, strerror(errno));
-    free(root_path);
-
 #ifdef __linux__
     events_fd = inotify_init1(IN_NONBLOCK);
     if (events_fd == -1) ERROR("Unable to initialize inotify: %s.\n", strerror(errno));
@@ -153,6 +222,11 @@ void poll_init(void) {
 
     poll_fds[0] = (struct pollfd){STDIN_FILENO, POLLIN, 0};
     poll_fds[1] = (struct pollfd){events_fd, POLLIN, 0};
+    poll_fds[2] = (struct pollfd){-1, POLLIN, 0};
+    poll_fds[3] = (struct pollfd){-1, POLLIN, 0};
+    poll_fds[4] = (struct pollfd){-1, POLLIN, 0};
+    poll_fds[5] = (struct pollfd){-1, POLLIN, 0};
+    poll_fds[6] = (struct pollfd){-1, POLLIN, 0};
 }
 
 void poll_cleanup(void) {
@@ -167,56 +241,93 @@ void poll_cleanup(void) {
 }
 
 bool poll_events(State *state) {
-    static char event_buffer[1024];
+    // events that came along with sagit's own ones
+    if (pending_update) {
+        pending_update = false;
+        refresh_start(state);
+    }
 
-    if (poll(poll_fds, sizeof(poll_fds) / sizeof(poll_fds[0]), -1) == -1) {
+    // negative descriptors are ignored by poll
+    poll_fds[2].fd = loader_fd();
+    poll_fds[3].fd = renames_fd();
+    poll_fds[4].fd = refresh_fd();
+    poll_fds[5].fd = staging_fd();
+    poll_fds[6].fd = fetch_fd();
+    int timeout = -1;
+    if (!journal_is_empty()) timeout = JOURNAL_DELAY_MS;
+    // queued operations would be verified before they are finished
+    else if (needs_verification() && staging_pending() == 0) timeout = VERIFICATION_DELAY_MS;
+    int ready = poll(poll_fds, sizeof(poll_fds) / sizeof(poll_fds[0]), timeout);
+    if (ready == -1) {
         if (errno == EINTR) return false;
         ERROR("Unable to poll: %s.\n", strerror(errno));
     }
 
-    if ((poll_fds[1].revents & POLLIN) == 0) return true;
-
-#ifdef __linux__
-    bool reindex = false;
-
-    ssize_t bytes;
-    while ((bytes = read(events_fd, event_buffer, sizeof(event_buffer))) > 0) {
-        if (reindex) continue;
-
-        for (ssize_t i = 0; i < bytes; i += sizeof(struct inotify_event)) {
-            struct inotify_event *event = (struct inotify_event *) (event_buffer + i);
-            i += event->len;
+    if (ready == 0) {
+        if (journal_is_empty()) {
+            refresh_start(state);
+        } else {
+            journal_flush();
+            render(state);
+        }
+        return false;
+    }
 
-            if ((event->mask & IN_CREATE) == IN_CREATE) {
-                reindex = true;
-                break;
+    if (poll_fds[2].revents & POLLIN) {
+        if (loader_collect(state)) render(state);
+        return false;
+    }
+    if (poll_fds[3].revents & POLLIN) {
+        if (renames_collect(state)) render(state);
+        return false;
+    }
+    if (poll_fds[4].revents & POLLIN) {
+        if (refresh_collect(state)) render(state);
+        return false;
+    }
+    if (poll_fds[5].revents & POLLIN) {
+        if (staging_collect()) {
+            // changed files are diffed once, after the last queued operation
+            if (staging_pending() == 0) {
+                update_changed_files(state);
+                poll_ignore_own_events();
             }
+            render(state);
         }
+        return false;
     }
-    if (bytes == -1 && errno != EAGAIN) ERROR("Unable to read inotify event: %s\n", strerror(errno));
 
-    if (reindex) watch_dirs();
+    if (poll_fds[6].revents & POLLIN) {
+        if (fetch_collect(state)) render(state);
+        return false;
+    }
+
+    if ((poll_fds[1].revents & POLLIN) == 0) return true;
+
+#ifdef __linux__
+    bool is_changed = read_events(false);
 #else
     ssize_t bytes;
     while ((bytes = read(events_fd, event_buffer, sizeof(event_buffer))) > 0) continue;
     if (bytes == -1 && errno != EAGAIN) ERROR("Unable to read from pipe: %s.\n", strerror(errno));
-#endif
-
-    if (ignore_event) {
-        ignore_event = false;
-    } else {
-        // if a key is pressed during external update, ignore that key
-        if (poll_fds[0].revents & POLLIN) {
-            while (getch() != ERR) continue;
-        }
 
-        update_git_state(state);
-        render(state);
-
-        return false;
-    }
+    bool is_changed = !ignore_event;
+    ignore_event = false;
+#endif
 
-    return true;
+    // current state stays on the screen and keeps taking keys until the new one is loaded
+    if (is_changed) refresh_start(state);
+    return (poll_fds[0].revents & POLLIN) != 0;
 }
 
-void poll_ignore_event(void) { ignore_event = true; }
+void poll_ignore_own_events(void) {
+#ifdef __linux__
+    is_own_index_known = stat_index(&own_index);
+    // Own commands have already exited, so all of their events are queued by now.
+    // Any other event is kept for the next poll.
+    if (read_events(true)) pending_update = true;
+#else
+    // FSEvents are delivered with a delay and coalesced, so only the next batch is ignored
+    ignore_event = true;
+#endif
+}
@@ -9,6 +9,9 @@ void poll_cleanup(void);
 
 // Polls for either file change or key. Returns whether key was pressed
 bool poll_events(State *state);
-void poll_ignore_event(void);
+// Discards filesystem events caused by sagit's own changes to the index and remembers the index as
+// they have left it, so that later changes made by someone else are told apart from them.
+// Must be called after the command which changed it has exited.
+void poll_ignore_own_events(void);
 
 #endif  // EVENT_H
@@ -0,0 +1,324 @@
+#define _DEFAULT_SOURCE
+#include "catfile.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "error.h"
+#include "git/exec.h"
+#include "memstat.h"
+
+#define INITIAL_BUFFER_SIZE 4096
+
+// clang-format off
+static char *const CMD_BATCH[]       = {"git", "cat-file", "--batch", NULL};
+static char *const CMD_BATCH_CHECK[] = {"git", "cat-file", "--batch-check", NULL};
+// clang-format on
+
+typedef struct {
+    char *const *args;
+    pthread_mutex_t mutex;  // held for the whole batch
+    pid_t pid;
+    int in_fd;   // non-blocking, see `coprocess_fill`
+    int out_fd;
+    // requests of the current batch, [0, written) has been sent
+    const char *request;
+    size_t request_size;
+    size_t written;
+    // buffered child's stdout, [start, end) hasn't been consumed yet
+    char *buffer;
+    size_t capacity;
+    size_t start;
+    size_t end;
+} Coprocess;
+
+static Coprocess batch = {CMD_BATCH, PTHREAD_MUTEX_INITIALIZER, -1, -1, -1, NULL, 0, 0, NULL, 0, 0, 0};
+static Coprocess batch_check = {CMD_BATCH_CHECK, PTHREAD_MUTEX_INITIALIZER, -1, -1, -1, NULL, 0, 0, NULL, 0, 0, 0};
+
+static void coprocess_start(Coprocess *cp) {
+    ASSERT(cp != NULL && cp->pid == -1);
+
+    if (cp->buffer == NULL) {
+        cp->capacity = INITIAL_BUFFER_SIZE;
+        cp->buffer = (char *) mem_alloc(MEM_GIT_OUTPUT, cp->capacity);
+    }
+
+    cp->pid = gexecp(cp->args, &cp->in_fd, &cp->out_fd);
+    cp->start = 0;
+    cp->end = 0;
+
+    int flags = fcntl(cp->in_fd, F_GETFL, 0);
+    if (flags == -1 || fcntl(cp->in_fd, F_SETFL, flags | O_NONBLOCK) == -1)
+        ERROR("Unable to make file description non-blocking: %s.\n", strerror(errno));
+}
+
+static void coprocess_stop(Coprocess *cp, bool force) {
+    ASSERT(cp != NULL);
+    if (cp->pid == -1) return;
+
+    // closing stdin makes cat-file exit after it answers pending requests
+    close(cp->in_fd);
+    close(cp->out_fd);
+    if (force) kill(cp->pid, SIGKILL);
+    gwait(cp->pid);
+
+    cp->pid = -1;
+    cp->in_fd = -1;
+    cp->out_fd = -1;
+}
+
+static void coprocess_restart(Coprocess *cp) {
+    ASSERT(cp != NULL);
+
+    coprocess_stop(cp, true);
+    coprocess_start(cp);
+}
+
+// Starts sending `request`, which must stay valid until all of its replies are read.
+static void coprocess_send(Coprocess *cp, const char *request, size_t size) {
+    ASSERT(cp != NULL && request != NULL);
+
+    cp->request = request;
+    cp->request_size = size;
+    cp->written = 0;
+}
+
+// Sends as much of the request as the pipe takes. Returns false if child has died.
+static bool coprocess_flush(Coprocess *cp) {
+    ASSERT(cp != NULL);
+
+    while (cp->written < cp->request_size) {
+        ssize_t bytes = write(cp->in_fd, cp->request + cp->written, cp->request_size - cp->written);
+        if (bytes == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) return true;
+            // EPIPE means that child has died (SIGPIPE is ignored)
+            return false;
+        }
+        cp->written += bytes;
+    }
+
+    return true;
+}
+
+// Reads more of child's stdout into the buffer, writing the rest of the request meanwhile.
+// Child stops reading requests while its stdout is full, so both pipes have to be served at once.
+// Returns false if child has died.
+static bool coprocess_fill(Coprocess *cp) {
+    ASSERT(cp != NULL);
+
+    if (cp->start > 0) {
+        memmove(cp->buffer, cp->buffer + cp->start, cp->end - cp->start);
+        cp->end -= cp->start;
+        cp->start = 0;
+    }
+
+    if (cp->end == cp->capacity) {
+        cp->capacity *= 2;
+        cp->buffer = (char *) mem_realloc(MEM_GIT_OUTPUT, cp->buffer, cp->capacity);
+    }
+
+    while (true) {
+        struct pollfd fds[2] = {{cp->out_fd, POLLIN, 0}, {cp->in_fd, POLLOUT, 0}};
+        nfds_t length = cp->written < cp->request_size ? 2 : 1;
+        if (poll(fds, length, -1) == -1) {
+            if (errno == EINTR) continue;
+            ERROR("Unable to poll cat-file's pipes: %s.\n", strerror(errno));
+        }
+
+        if (length == 2 && fds[1].revents != 0 && !coprocess_flush(cp)) return false;
+        if (fds[0].revents == 0) continue;
+
+        ssize_t bytes;
+        while ((bytes = read(cp->out_fd, cp->buffer + cp->end, cp->capacity - cp->end)) == -1 && errno == EINTR) continue;
+        if (bytes <= 0) return false;
+
+        cp->end += bytes;
+        return true;
+    }
+}
+
+// Returns the next line without '\n', it is valid until the next read. Returns NULL if child has died.
+static char *coprocess_read_line(Coprocess *cp) {
+    ASSERT(cp != NULL);
+
+    // offset from `start`, which is moved by coprocess_fill
+    size_t scanned = 0;
+    char *newline;
+    while ((newline = (char *) memchr(cp->buffer + cp->start + scanned, '\n', cp->end - cp->start - scanned)) == NULL) {
+        scanned = cp->end - cp->start;
+        if (!coprocess_fill(cp)) return NULL;
+    }
+
+    char *line = cp->buffer + cp->start;
+    *newline = '\0';
+    cp->start = newline + 1 - cp->buffer;
+    return line;
+}
+
+static bool coprocess_read(Coprocess *cp, char *dest, size_t size) {
+    ASSERT(cp != NULL && dest != NULL);
+
+    while (size > 0) {
+        if (cp->start == cp->end && !coprocess_fill(cp)) return false;
+
+        size_t available = cp->end - cp->start;
+        size_t bytes = available < size ? available : size;
+        memcpy(dest, cp->buffer + cp->start, bytes);
+        cp->start += bytes;
+        dest += bytes;
+        size -= bytes;
+    }
+
+    return true;
+}
+
+// Returns object names separated by newlines, which is the request of cat-file. It must be freed.
+static char *join_objects(const char *const *objects, size_t length, size_t *size) {
+    ASSERT(objects != NULL && size != NULL);
+
+    *size = 0;
+    for (size_t i = 0; i < length; i++) *size += strlen(objects[i]) + 1;
+
+    char *request = (char *) malloc(*size);
+    if (request == NULL) OUT_OF_MEMORY();
+
+    char *ptr = request;
+    for (size_t i = 0; i < length; i++) {
+        ASSERT(strchr(objects[i], '\n') == NULL);
+
+        size_t len = strlen(objects[i]);
+        memcpy(ptr, objects[i], len);
+        ptr += len;
+        *ptr++ = '\n';
+    }
+
+    return request;
+}
+
+// Parses "<id> <type> <size>" or "<object> missing".
+static void parse_info(const char *line, ObjectInfo *info) {
+    ASSERT(line != NULL && info != NULL);
+
+    *info = (ObjectInfo){0};
+    const char *space = strrchr(line, ' ');
+    if (space != NULL && (strcmp(space, " missing") == 0 || strcmp(space, " ambiguous") == 0)) return;
+
+    if (sscanf(line, "%64s %16s %zu", info->id, info->type, &info->size) != 3) ERROR("Unable to parse cat-file output: \"%s\".\n", line);
+    info->exists = true;
+}
+
+// Returns whether the child has responded to all of the requests.
+static bool try_info(const char *request, size_t request_size, size_t length, ObjectInfo *infos) {
+    ASSERT(request != NULL && infos != NULL);
+
+    coprocess_send(&batch_check, request, request_size);
+    for (size_t i = 0; i < length; i++) {
+        char *line = coprocess_read_line(&batch_check);
+        if (line == NULL) return false;
+        parse_info(line, &infos[i]);
+    }
+
+    ASSERT(batch_check.written == request_size);
+    return true;
+}
+
+void catfile_info(const char *const *objects, size_t length, ObjectInfo *infos) {
+    ASSERT(objects != NULL && infos != NULL);
+    if (length == 0) return;
+
+    size_t request_size;
+    char *request = join_objects(objects, length, &request_size);
+
+    pthread_mutex_lock(&batch_check.mutex);
+    if (batch_check.pid == -1) coprocess_start(&batch_check);
+    if (!try_info(request, request_size, length, infos)) {
+        coprocess_restart(&batch_check);
+        if (!try_info(request, request_size, length, infos)) ERROR("Unable to communicate with git cat-file.\n");
+    }
+    pthread_mutex_unlock(&batch_check.mutex);
+
+    free(request);
+}
+
+static void free_contents(char **contents, size_t length) {
+    ASSERT(contents != NULL);
+
+    for (size_t i = 0; i < length; i++) {
+        mem_free(contents[i]);
+        contents[i] = NULL;
+    }
+}
+
+// Returns whether the child has responded to all of the requests, `contents` are freed if it hasn't.
+static bool try_read(const char *request, size_t request_size, size_t length, char **contents, size_t *sizes) {
+    ASSERT(request != NULL && contents != NULL && sizes != NULL);
+
+    coprocess_send(&batch, request, request_size);
+    for (size_t i = 0; i < length; i++) {
+        contents[i] = NULL;
+        sizes[i] = 0;
+
+        char *line = coprocess_read_line(&batch);
+        if (line == NULL) {
+            free_contents(contents, i);
+            return false;
+        }
+
+        ObjectInfo info;
+        parse_info(line, &info);
+        if (!info.exists) continue;
+
+        // contents are followed by '\n'
+        char *buffer = (char *) mem_alloc(MEM_GIT_OUTPUT, info.size + 1);
+        char newline;
+        if (!coprocess_read(&batch, buffer, info.size) || !coprocess_read(&batch, &newline, 1)) {
+            mem_free(buffer);
+            free_contents(contents, i);
+            return false;
+        }
+        buffer[info.size] = '\0';
+
+        contents[i] = buffer;
+        sizes[i] = info.size;
+    }
+
+    ASSERT(batch.written == request_size);
+    return true;
+}
+
+void catfile_read(const char *const *objects, size_t length, char **contents, size_t *sizes) {
+    ASSERT(objects != NULL && contents != NULL && sizes != NULL);
+    if (length == 0) return;
+
+    size_t request_size;
+    char *request = join_objects(objects, length, &request_size);
+
+    pthread_mutex_lock(&batch.mutex);
+    if (batch.pid == -1) coprocess_start(&batch);
+    if (!try_read(request, request_size, length, contents, sizes)) {
+        coprocess_restart(&batch);
+        if (!try_read(request, request_size, length, contents, sizes)) ERROR("Unable to communicate with git cat-file.\n");
+    }
+    pthread_mutex_unlock(&batch.mutex);
+
+    free(request);
+}
+
+void catfile_cleanup(void) {
+    Coprocess *coprocesses[] = {&batch, &batch_check};
+    for (size_t i = 0; i < sizeof(coprocesses) / sizeof(coprocesses[0]); i++) {
+        Coprocess *cp = coprocesses[i];
+
+        pthread_mutex_lock(&cp->mutex);
+        coprocess_stop(cp, false);
+        mem_free(cp->buffer);
+        cp->buffer = NULL;
+        pthread_mutex_unlock(&cp->mutex);
+    }
+}
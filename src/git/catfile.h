@@ -0,0 +1,34 @@
+#ifndef CATFILE_H
+#define CATFILE_H
+
+#include <ncurses.h>
+#include <stdlib.h>
+
+// Long-lived `git cat-file --batch` and `--batch-check` coprocesses, which are
+// started on the first request and kept for the whole session. Each batch of lookups
+// costs a round trip over a pipe instead of spawning git. Requests are pipelined:
+// they are written while the replies are being read, so neither process blocks on
+// a full pipe. If a coprocess dies, it is restarted and the batch is retried.
+// Functions may be called from any thread, each coprocess serves one batch at a time.
+
+#define OBJECT_ID_SIZE 64  // enough for SHA-256
+#define OBJECT_TYPE_SIZE 16
+
+typedef struct {
+    bool exists;
+    char id[OBJECT_ID_SIZE + 1];
+    char type[OBJECT_TYPE_SIZE + 1];
+    size_t size;
+} ObjectInfo;
+
+// Looks up `length` objects by their names (anything `git rev-parse` understands, e.g. "HEAD" or ":path"
+// for a blob in the index), writing results into `infos`.
+void catfile_info(const char *const *objects, size_t length, ObjectInfo *infos);
+
+// Reads `length` objects, `contents[i]` is set to the contents allocated with `mem_alloc` and null-terminated,
+// or to NULL if the object doesn't exist. Sizes are written to `sizes`.
+void catfile_read(const char *const *objects, size_t length, char **contents, size_t *sizes);
+
+void catfile_cleanup(void);
+
+#endif  // CATFILE_H
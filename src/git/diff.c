@@ -0,0 +1,545 @@
+#define _GNU_SOURCE
+#include "diff.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "error.h"
+#include "git/state.h"
+#include "memstat.h"
+#include "vector.h"
+
+// First block fits the first chunk, so that a diff which is fed at once (e.g. of a single file) takes only
+// as much as it needs. Next blocks are twice as big as the previous one up to this size, or twice as big
+// as the section that doesn't fit.
+#define MAX_DOUBLED_BLOCK_SIZE (1024 * 1024)
+
+// Diff is spooled to files once it is this big (see `map_spooled_block`), spooled blocks are bigger to have fewer mappings
+#define MIN_SPOOL_SIZE (64 * 1024 * 1024)
+#define MIN_SPOOLED_BLOCK_SIZE (16 * 1024 * 1024)
+#define SPOOL_DIR "/var/tmp"
+
+// Complete sections are parsed in batches, which are split between threads by size.
+// Batches start small and grow, so that the first files are shown right away.
+#define MIN_PARSE_BATCH_SIZE (64 * 1024)
+#define MAX_PARSE_BATCH_SIZE (8 * 1024 * 1024)
+// Smaller batches are parsed on the calling thread, splitting them would cost more than it saves
+#define MIN_PARALLEL_PARSE_SIZE (1024 * 1024)
+#define MAX_PARSE_THREADS 8
+
+// Every file's section starts at the beginning of a line with it
+#define FILE_BOUNDARY "\ndiff --git "
+
+#define STARTS_WITH(str, prefix) (strncmp((str), (prefix), sizeof(prefix) - 1) == 0)
+
+// Same set of characters as `isspace` in "C" locale
+#define WHITESPACE " \t\n\v\f\r"
+
+// Parses "diff --git a/<src> b/<dst>", null-terminating both paths in place.
+static void parse_file_header(char *line, File *file) {
+    ASSERT(line != NULL && file != NULL);
+
+    if (!STARTS_WITH(line, "diff --git a/")) ERROR("Unable to parse file diff header.\n");
+    char *src = line + sizeof("diff --git a/") - 1;
+    char *src_end = src + strcspn(src, WHITESPACE);
+
+    if (!STARTS_WITH(src_end, " b/")) ERROR("Unable to parse file diff header.\n");
+    char *dst = src_end + sizeof(" b/") - 1;
+    char *dst_end = dst + strcspn(dst, WHITESPACE);
+
+    *src_end = '\0';
+    *dst_end = '\0';
+    file->src = src;
+    file->dst = dst;
+}
+
+// Extended header lines are told apart by their first byte.
+static void parse_file_metadata(const char *line, File *file) {
+    ASSERT(line != NULL && file != NULL);
+
+    switch (line[0]) {
+        case 'B':
+            if (STARTS_WITH(line, "Binary files ")) file->is_binary = true;
+            break;
+        case 'n':
+            if (STARTS_WITH(line, "new file mode")) file->change_type = FC_CREATED;
+            else if (STARTS_WITH(line, "new mode")) file->new_mode = line + 9;
+            break;
+        case 'd':
+            if (STARTS_WITH(line, "deleted file mode")) file->change_type = FC_DELETED;
+            break;
+        case 'o':
+            if (STARTS_WITH(line, "old mode")) file->old_mode = line + 9;
+            break;
+        case '-':
+            if (!STARTS_WITH(line, "--- ")) break;
+            if (file->change_type == FC_CREATED) ASSERT(strcmp(line + 4, "/dev/null") == 0);
+            else ASSERT(strcmp(line + 6, file->src) == 0);
+            break;
+        case '+':
+            if (!STARTS_WITH(line, "+++ ")) break;
+            if (file->change_type == FC_DELETED) ASSERT(strcmp(line + 4, "/dev/null") == 0);
+            else ASSERT(strcmp(line + 6, file->dst) == 0);
+            break;
+    }
+}
+
+#define FINGERPRINT_PRIME1 0x9E3779B97F4A7C15ULL
+#define FINGERPRINT_PRIME2 0xC2B2AE3D27D4EB4FULL
+
+#define ROTATE_LEFT(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+
+// Reads 8 bytes at a time, final mix is from MurmurHash3.
+uint64_t fingerprint(const char *data, size_t length) {
+    ASSERT(data != NULL || length == 0);
+
+    uint64_t hash = length * FINGERPRINT_PRIME1;
+    const char *end = data + length;
+    for (; end - data >= 8; data += 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        hash ^= ROTATE_LEFT(word * FINGERPRINT_PRIME2, 31) * FINGERPRINT_PRIME1;
+        hash = ROTATE_LEFT(hash, 27) * FINGERPRINT_PRIME1 + FINGERPRINT_PRIME2;
+    }
+    for (; data < end; data++) {
+        hash ^= (uint8_t) *data * FINGERPRINT_PRIME1;
+        hash = ROTATE_LEFT(hash, 11) * FINGERPRINT_PRIME2;
+    }
+
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDULL;
+    hash ^= hash >> 33;
+    hash *= 0xC4CEB9FE1A85EC53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static LineKind get_line_kind(char ch) {
+    switch (ch) {
+        case '+': return LK_ADD;
+        case '-': return LK_DEL;
+        case '\\': return LK_NO_NEWLINE;
+        case '@': return LK_HUNK;
+        default: return LK_CONTEXT;
+    }
+}
+
+// Parses a non-negative number and moves `str` past it.
+static bool parse_number(const char **str, int *number) {
+    ASSERT(str != NULL && number != NULL);
+
+    const char *ch = *str;
+    if (*ch < '0' || *ch > '9') return false;
+
+    int value = 0;
+    for (; *ch >= '0' && *ch <= '9'; ch++) {
+        if (value > (INT_MAX - (*ch - '0')) / 10) return false;
+        value = value * 10 + (*ch - '0');
+    }
+
+    *number = value;
+    *str = ch;
+    return true;
+}
+
+// Parses "<sign><start>[,<length>]", omitted length means a single line.
+static bool parse_hunk_range(const char **str, char sign, int *start, int *length) {
+    ASSERT(str != NULL && start != NULL && length != NULL);
+
+    if (**str != sign) return false;
+    (*str)++;
+    if (!parse_number(str, start)) return false;
+
+    *length = 1;
+    if (**str != ',') return true;
+    (*str)++;
+    return parse_number(str, length);
+}
+
+// Parses "@@ -<old_start>,<old_length> +<new_start>,<new_length> @@", `line` is terminated by '\n' or '\0'.
+static void parse_hunk_header(const char *line, Hunk *hunk) {
+    ASSERT(line != NULL && hunk != NULL);
+
+    int length = strcspn(line, "\n");
+    const char *ch = line;
+    if (!STARTS_WITH(ch, "@@ ")) ERROR("Unable to parse hunk header: \"%.*s\".\n", length, line);
+    ch += sizeof("@@ ") - 1;
+
+    if (!parse_hunk_range(&ch, '-', &hunk->old_start, &hunk->old_length) || *ch++ != ' '
+        || !parse_hunk_range(&ch, '+', &hunk->new_start, &hunk->new_length) || !STARTS_WITH(ch, " @@")) {
+        ERROR("Unable to parse hunk header: \"%.*s\".\n", length, line);
+    }
+}
+
+// Newlines are found with memchr, which is vectorized by libc, and the table is sized up front.
+void load_hunks(File *file, MemoryContext *ctxt) {
+    ASSERT(file != NULL && ctxt != NULL);
+    // files without hunks have no lines, so this check is only true until hunks are loaded
+    if (file->raw_length == 0 || file->line_offsets != NULL) return;
+    if (file->raw_length >= UINT32_MAX) ERROR("Diff of \"%s\" is too big.\n", file->dst);
+
+    char *text = file->raw;
+    char *end = text + file->raw_length;
+    // only hunk headers start with '@', so everything is allocated up front
+    size_t lines_count = 0, hunks_count = 1;
+    for (char *ch = text; (ch = (char *) memchr(ch, '\n', end - ch)) != NULL; ch++) {
+        lines_count++;
+        if (ch + 1 < end && ch[1] == '@') hunks_count++;
+    }
+    if (end[-1] != '\n') lines_count++;
+    file->lines_count = lines_count;
+
+    uint32_t *offsets = (uint32_t *) ctxt_alloc(ctxt, (lines_count + 1) * sizeof(*offsets));
+    uint8_t *kinds = (uint8_t *) ctxt_alloc(ctxt, lines_count * sizeof(*kinds));
+    file->hunks.data = (Hunk *) ctxt_alloc(ctxt, hunks_count * sizeof(Hunk));
+    file->hunks.capacity = hunks_count;
+
+    char *line = text;
+    for (size_t i = 0; i < lines_count; i++) {
+        char *newline = (char *) memchr(line, '\n', end - line);
+        if (newline == NULL) newline = end;
+
+        offsets[i] = line - text;
+        kinds[i] = get_line_kind(line[0]);
+        if (kinds[i] == LK_HUNK) {
+            Hunk hunk = {0};
+            hunk.first_line = i + 1;
+            parse_hunk_header(line, &hunk);
+            ASSERT(file->hunks.length < file->hunks.capacity);
+            file->hunks.data[file->hunks.length++] = hunk;
+        } else {
+            ASSERT(file->hunks.length > 0);
+            file->hunks.data[file->hunks.length - 1].lines_count++;
+        }
+
+        line = newline + 1;
+    }
+    offsets[lines_count] = line - text;
+
+    file->line_offsets = offsets;
+    file->line_kinds = kinds;
+}
+
+// Parses section of a single file, it must be terminated by '\n' or '\0'.
+static void parse_file(char *section, size_t length, File *file) {
+    ASSERT(section != NULL && file != NULL);
+
+    *file = (File){0};
+    file->is_folded = true;
+    file->change_type = FC_MODIFIED;
+    // before the header lines are null-terminated
+    file->fingerprint = fingerprint(section, length);
+
+    // header lines are parsed until the first hunk
+    char *end = section + length;
+    char *line = section;
+    bool is_header = true;
+    while (line < end && (is_header || line[0] != '@')) {
+        char *newline = (char *) memchr(line, '\n', end - line);
+        if (newline == NULL) newline = end;
+        *newline = '\0';
+
+        if (is_header) parse_file_header(line, file);
+        else parse_file_metadata(line, file);
+        is_header = false;
+
+        line = newline + 1;
+    }
+    if (is_header) ERROR("Unable to parse file diff header.\n");
+    if (strcmp(file->src, file->dst) != 0) file->change_type = FC_RENAMED;
+
+    if (line < end) {
+        file->raw = line;
+        file->raw_length = end - line;
+    }
+}
+
+// Consecutive sections of a batch, parsed by a single thread.
+typedef struct _ParseShard {
+    char *block;
+    size_t start;
+    const size_t *section_ends;
+    size_t length;
+    FileVec files;
+    struct _ParseShard *next;  // in the queue of the pool
+    size_t *pending;           // shards of the batch which haven't been parsed yet, protected by the pool's mutex
+} ParseShard;
+
+// Shards of parallel batches are parsed by a pool of threads, which is started with the first such batch
+// and lives until sagit exits, so that batches don't pay for creating threads. Batches may be parsed by
+// several threads at once (e.g. loader and refresh), all of them share the queue.
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static size_t pool_threads = 0;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t is_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t is_parsed = PTHREAD_COND_INITIALIZER;
+static ParseShard *queue_head = NULL;
+static ParseShard *queue_tail = NULL;
+
+static void parse_shard(ParseShard *shard) {
+    ASSERT(shard != NULL);
+
+    VECTOR_RESERVE(&shard->files, shard->length);
+    size_t start = shard->start;
+    for (size_t i = 0; i < shard->length; i++) {
+        File file;
+        parse_file(shard->block + start, shard->section_ends[i] - start, &file);
+        VECTOR_PUSH(&shard->files, file);
+        start = shard->section_ends[i];
+    }
+}
+
+// Called with the pool's mutex held, returns NULL if the queue is empty.
+static ParseShard *pop_shard(void) {
+    ParseShard *shard = queue_head;
+    if (shard != NULL) queue_head = shard->next;
+    if (queue_head == NULL) queue_tail = NULL;
+    return shard;
+}
+
+// Called with the pool's mutex held, which is released while the shard is parsed.
+static void parse_queued_shard(ParseShard *shard) {
+    ASSERT(shard != NULL);
+
+    pthread_mutex_unlock(&pool_mutex);
+    parse_shard(shard);
+    pthread_mutex_lock(&pool_mutex);
+
+    (*shard->pending)--;
+    pthread_cond_broadcast(&is_parsed);
+}
+
+static void *serve_pool(void *arg) {
+    (void) arg;
+
+    pthread_mutex_lock(&pool_mutex);
+    while (true) {
+        while (queue_head == NULL) pthread_cond_wait(&is_queued, &pool_mutex);
+        parse_queued_shard(pop_shard());
+    }
+
+    return NULL;
+}
+
+static void start_pool(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t threads = cpus > 0 ? (size_t) cpus : 1;
+    if (threads > MAX_PARSE_THREADS) threads = MAX_PARSE_THREADS;
+
+    // calling thread parses a shard too
+    for (pool_threads = 0; pool_threads + 1 < threads; pool_threads++) {
+        pthread_t thread;
+        int error = pthread_create(&thread, NULL, &serve_pool, NULL);
+        if (error != 0) ERROR("Unable to create parsing thread: %s.\n", strerror(error));
+        pthread_detach(thread);
+    }
+}
+
+static size_t get_parse_threads(size_t sections) {
+    pthread_once(&pool_once, &start_pool);
+
+    size_t threads = pool_threads + 1;
+    if (threads > sections) threads = sections;
+    return threads;
+}
+
+// Parses queued sections and emits their files in order.
+static void parse_batch(DiffParser *parser) {
+    ASSERT(parser != NULL);
+
+    size_t sections = parser->section_ends.length;
+    if (sections == 0) return;
+    const size_t *section_ends = parser->section_ends.data;
+    size_t batch_start = parser->section_start;
+    size_t batch_end = section_ends[sections - 1];
+
+    size_t threads = batch_end - batch_start < MIN_PARALLEL_PARSE_SIZE ? 1 : get_parse_threads(sections);
+    if (threads == 1) {
+        size_t start = batch_start;
+        for (size_t i = 0; i < sections; i++) {
+            File file;
+            parse_file(parser->block + start, section_ends[i] - start, &file);
+            parser->on_file(&file, parser->arg);
+            start = section_ends[i];
+        }
+    } else {
+        ParseShard shards[MAX_PARSE_THREADS] = {0};
+        size_t pending = threads - 1;
+
+        // shard ends where its share of bytes is reached, the last one takes the rest
+        size_t section = 0;
+        for (size_t i = 0; i < threads; i++) {
+            size_t first = section;
+            size_t target = batch_start + (batch_end - batch_start) * (i + 1) / threads;
+            while (section < sections && (i == threads - 1 || section_ends[section] <= target)) section++;
+
+            size_t start = first == 0 ? batch_start : section_ends[first - 1];
+            shards[i] = (ParseShard){parser->block, start, section_ends + first, section - first, {0}, NULL, &pending};
+        }
+
+        // the first shard is parsed by the calling thread, the rest are queued for the pool
+        pthread_mutex_lock(&pool_mutex);
+        for (size_t i = 1; i < threads; i++) {
+            if (queue_tail == NULL) queue_head = &shards[i];
+            else queue_tail->next = &shards[i];
+            queue_tail = &shards[i];
+        }
+        pthread_cond_broadcast(&is_queued);
+        pthread_mutex_unlock(&pool_mutex);
+
+        parse_shard(&shards[0]);
+
+        // while its shards are being parsed, the thread helps with queued ones, which may be of other batches
+        pthread_mutex_lock(&pool_mutex);
+        while (pending > 0) {
+            ParseShard *shard = pop_shard();
+            if (shard != NULL) parse_queued_shard(shard);
+            else pthread_cond_wait(&is_parsed, &pool_mutex);
+        }
+        pthread_mutex_unlock(&pool_mutex);
+
+        for (size_t i = 0; i < threads; i++) {
+            for (size_t j = 0; j < shards[i].files.length; j++) parser->on_file(&shards[i].files.data[j], parser->arg);
+            VECTOR_FREE(&shards[i].files);
+        }
+    }
+
+    parser->section_start = batch_end;
+    VECTOR_RESET(&parser->section_ends);
+}
+
+// Returns a shared mapping of an unlinked temporary file, whose pages the kernel is able to write
+// back and drop, unlike anonymous memory. Returns NULL if the file can't be created or there isn't enough space for it.
+// The repository isn't used, because its changes are watched.
+static char *map_spooled_block(size_t size) {
+    // /tmp is often in memory
+    const char *dir = getenv("TMPDIR");
+    if (dir == NULL || dir[0] == '\0') dir = SPOOL_DIR;
+
+    int fd = -1;
+#ifdef O_TMPFILE
+    fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+#endif
+    if (fd == -1) {
+        char path[PATH_MAX];
+        if (snprintf(path, sizeof(path), "%s/sagit-spool-XXXXXX", dir) >= (int) sizeof(path)) return NULL;
+        if ((fd = mkstemp(path)) == -1) return NULL;
+        unlink(path);
+    }
+
+    char *data = NULL;
+    // blocks are reserved up front, writing to a hole of a sparse file on a full disk would raise SIGBUS
+    if (posix_fallocate(fd, 0, size) == 0) {
+        data = (char *) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED) data = NULL;
+    }
+    // mapping keeps the file
+    close(fd);
+
+    if (data != NULL) mem_account(MEM_SPOOLED_TEXT, size);
+    return data;
+}
+
+static void keep_block(DiffParser *parser) {
+    ASSERT(parser != NULL && parser->block != NULL);
+
+    TextBlock block = {parser->block, parser->is_block_mapped ? parser->capacity : 0};
+    if (parser->section_start > 0) VECTOR_PUSH(parser->blocks, block);
+    else free_text_block(&block);
+}
+
+// Moves the incomplete section into a new block which fits `size` more bytes.
+// Previous block is kept only if it contains emitted files.
+static void grow_block(DiffParser *parser, size_t size) {
+    ASSERT(parser != NULL);
+
+    size_t pending = parser->length - parser->section_start;
+    size_t capacity = 2 * (pending + size + 1);
+    bool is_spooled = parser->total_length + size >= MIN_SPOOL_SIZE;
+    if (is_spooled) {
+        if (capacity < MIN_SPOOLED_BLOCK_SIZE) capacity = MIN_SPOOLED_BLOCK_SIZE;
+    } else if (parser->block == NULL) {
+        capacity = pending + size + 1;
+    } else {
+        size_t doubled = 2 * parser->capacity < MAX_DOUBLED_BLOCK_SIZE ? 2 * parser->capacity : MAX_DOUBLED_BLOCK_SIZE;
+        if (capacity < doubled) capacity = doubled;
+    }
+
+    char *block = is_spooled ? map_spooled_block(capacity) : NULL;
+    bool is_mapped = block != NULL;
+    if (!is_mapped) block = (char *) mem_alloc(MEM_DIFF_TEXT, capacity);
+    if (pending > 0) memcpy(block, parser->block + parser->section_start, pending);
+
+    if (parser->block != NULL) keep_block(parser);
+
+    for (size_t i = 0; i < parser->section_ends.length; i++) parser->section_ends.data[i] -= parser->section_start;
+    parser->scanned = parser->scanned > parser->section_start ? parser->scanned - parser->section_start : 0;
+    parser->block = block;
+    parser->capacity = capacity;
+    parser->is_block_mapped = is_mapped;
+    parser->length = pending;
+    parser->section_start = 0;
+}
+
+// Returns end of the queued sections, which is where the incomplete section starts.
+static size_t get_queued_end(const DiffParser *parser) {
+    ASSERT(parser != NULL);
+
+    if (parser->section_ends.length == 0) return parser->section_start;
+    return parser->section_ends.data[parser->section_ends.length - 1];
+}
+
+void diff_parser_init(DiffParser *parser, TextBlockVec *blocks, file_handler_t *on_file, void *arg) {
+    ASSERT(parser != NULL && blocks != NULL && on_file != NULL);
+    *parser = (DiffParser){blocks, on_file, arg, NULL, 0, 0, false, 0, 0, 0, MIN_PARSE_BATCH_SIZE, {0}};
+}
+
+void diff_parser_feed(const char *chunk, size_t size, void *_parser) {
+    DiffParser *parser = (DiffParser *) _parser;
+    ASSERT(chunk != NULL && parser != NULL);
+
+    // one byte is reserved for null-terminating the last section
+    if (parser->length + size + 1 > parser->capacity) grow_block(parser, size);
+    memcpy(parser->block + parser->length, chunk, size);
+    parser->length += size;
+    parser->total_length += size;
+
+    static const size_t boundary_length = sizeof(FILE_BOUNDARY) - 1;
+    size_t queued_end = get_queued_end(parser);
+    size_t from = parser->scanned > queued_end ? parser->scanned : queued_end;
+    char *boundary;
+    while ((boundary = (char *) memmem(parser->block + from, parser->length - from, FILE_BOUNDARY, boundary_length)) != NULL) {
+        queued_end = boundary - parser->block + 1;
+        VECTOR_PUSH(&parser->section_ends, queued_end);
+        from = queued_end;
+    }
+
+    if (queued_end - parser->section_start >= parser->batch_size) {
+        parse_batch(parser);
+        if (parser->batch_size < MAX_PARSE_BATCH_SIZE) parser->batch_size *= 2;
+    }
+
+    // boundary may be split between chunks
+    if (parser->length - from >= boundary_length) from = parser->length - boundary_length + 1;
+    parser->scanned = from;
+}
+
+void diff_parser_finish(DiffParser *parser) {
+    ASSERT(parser != NULL);
+
+    size_t queued_end = get_queued_end(parser);
+    if (parser->length > queued_end) {
+        parser->block[parser->length] = '\0';
+        VECTOR_PUSH(&parser->section_ends, parser->length);
+    }
+    parse_batch(parser);
+
+    if (parser->block != NULL) keep_block(parser);
+
+    VECTOR_FREE(&parser->section_ends);
+    parser->block = NULL;
+}
@@ -0,0 +1,49 @@
+#ifndef DIFF_H
+#define DIFF_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "ctxt.h"
+#include "git/state.h"
+#include "vector.h"
+
+// Called for every file as soon as its section of the diff is complete.
+typedef void file_handler_t(File *file, void *arg);
+
+// Incremental parser of `git diff` output. Text is stored in blocks, each file's
+// section is contiguous within a single block, so completed files stay valid while
+// the rest of the diff is still being read. Once the diff gets big, blocks are spooled
+// to unlinked temporary files and mapped, so that memory is only used by the pages
+// that are being accessed, e.g. text of shown files.
+typedef struct {
+    TextBlockVec *blocks;  // receives blocks, they must outlive parsed files
+    file_handler_t *on_file;
+    void *arg;
+    char *block;
+    size_t capacity;
+    size_t length;
+    bool is_block_mapped;
+    size_t total_length;    // bytes received so far
+    size_t section_start;   // start of the first section which hasn't been parsed
+    size_t scanned;         // file boundaries before this offset have already been searched for
+    size_t batch_size;      // complete sections are queued until they are at least this big
+    size_vec section_ends;  // queued sections, the next one starts where previous one ends
+} DiffParser;
+
+void diff_parser_init(DiffParser *parser, TextBlockVec *blocks, file_handler_t *on_file, void *arg);
+// Appends `chunk` of the diff and emits files whose sections are complete.
+// Signature matches `output_consumer_t`.
+void diff_parser_feed(const char *chunk, size_t size, void *parser);
+// Emits the last file and frees parser's resources.
+void diff_parser_finish(DiffParser *parser);
+
+// Builds line table and hunks of `file` from its `raw` text, which starts with a hunk header.
+// Only files that are unfolded or merged with unfolded ones are parsed, the rest
+// keep just the header. Does nothing if hunks are already loaded. Everything is allocated
+// from `ctxt`, which is the context of the state that the file belongs to.
+void load_hunks(File *file, MemoryContext *ctxt);
+
+// Fast non-cryptographic 64-bit hash, used to tell whether file's diff has changed.
+uint64_t fingerprint(const char *data, size_t length);
+
+#endif  // DIFF_H
@@ -1,140 +1,280 @@
+#define _GNU_SOURCE
 #include "exec.h"
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/fcntl.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include "error.h"
+#include "memstat.h"
 
 #define INITIAL_BUFFER_SIZE 1024
+#define CHUNK_SIZE (64 * 1024)
 
-#define NO_GIT_BINARY 100  // exit code for forked process
+#define NULL_FD -1  // redirects stream to /dev/null
 
-#define OPEN_PIPE(read_fd, write_fd)                                              \
-    int read_fd, write_fd;                                                        \
-    do {                                                                          \
-        int fds[2];                                                               \
-        if (pipe(fds) == -1) ERROR("Couldn't open pipe: %s.\n", strerror(errno)); \
-        read_fd = fds[0];                                                         \
-        write_fd = fds[1];                                                        \
-    } while (0);
+extern char **environ;
 
-int gexec(char *const *args) {
-    ASSERT(args != NULL);
+// Environment of git processes: sagit's one with optional locks disabled. Read-only commands
+// like `git status` would otherwise refresh and rewrite the index, which is reported as a change.
+// Commands that write the index take the lock regardless of this setting.
+static char **git_environ = NULL;
+// git is also spawned from the loading thread
+static pthread_once_t git_environ_once = PTHREAD_ONCE_INIT;
+
+static void init_git_environ(void) {
+    static char optional_locks[] = "GIT_OPTIONAL_LOCKS=0";
+    static const size_t optional_locks_length = sizeof("GIT_OPTIONAL_LOCKS=") - 1;
 
-    pid_t pid = fork();
-    if (pid == -1) ERROR("Couldn't fork process: %s.\n", strerror(errno));
-    if (pid == 0) {
-        int null_fd = open("/dev/null", O_WRONLY);
-        if (null_fd == -1) exit(1);
-        if (dup2(null_fd, STDOUT_FILENO) == -1) exit(1);
-        if (dup2(null_fd, STDERR_FILENO) == -1) exit(1);
-        close(null_fd);
+    size_t length = 0;
+    while (environ[length] != NULL) length++;
 
-        if (execvp("git", args) == -1) exit(errno == ENOENT ? NO_GIT_BINARY : 1);
+    git_environ = (char **) malloc((length + 2) * sizeof(char *));
+    if (git_environ == NULL) OUT_OF_MEMORY();
+
+    size_t j = 0;
+    for (size_t i = 0; i < length; i++) {
+        if (strncmp(environ[i], optional_locks, optional_locks_length) != 0) git_environ[j++] = environ[i];
     }
+    git_environ[j++] = optional_locks;
+    git_environ[j] = NULL;
+}
+
+// Pipes are opened with close-on-exec, the child only receives the ends that were dup2()-ed into it.
+#if defined(__linux__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__) || defined(__DragonFly__)
+#define LOCK_SPAWN()
+#define UNLOCK_SPAWN()
+#define OPEN_PIPE(read_fd, write_fd)                                                          \
+    int read_fd, write_fd;                                                                    \
+    do {                                                                                      \
+        int fds[2];                                                                           \
+        if (pipe2(fds, O_CLOEXEC) == -1) ERROR("Couldn't open pipe: %s.\n", strerror(errno)); \
+        read_fd = fds[0];                                                                     \
+        write_fd = fds[1];                                                                    \
+    } while (0);
+#else
+// Without pipe2(), a child spawned by another thread between pipe() and fcntl() would inherit both ends,
+// e.g. a stdin pipe of cat-file wouldn't get EOF until that child exits. Pipes are set up under the same
+// lock as spawning.
+static pthread_mutex_t spawn_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define LOCK_SPAWN() pthread_mutex_lock(&spawn_mutex)
+#define UNLOCK_SPAWN() pthread_mutex_unlock(&spawn_mutex)
+#define OPEN_PIPE(read_fd, write_fd)                                                              \
+    int read_fd, write_fd;                                                                        \
+    do {                                                                                          \
+        int fds[2];                                                                               \
+        LOCK_SPAWN();                                                                             \
+        if (pipe(fds) == -1) ERROR("Couldn't open pipe: %s.\n", strerror(errno));                 \
+        if (fcntl(fds[0], F_SETFD, FD_CLOEXEC) == -1 || fcntl(fds[1], F_SETFD, FD_CLOEXEC) == -1) \
+            ERROR("Couldn't set close-on-exec on pipe: %s.\n", strerror(errno));                  \
+        UNLOCK_SPAWN();                                                                           \
+        read_fd = fds[0];                                                                         \
+        write_fd = fds[1];                                                                        \
+    } while (0);
+#endif
 
-    int exit_code;
-    if (waitpid(pid, &exit_code, 0) == -1) ERROR("Couldn't wait for child process: %s.\n", strerror(errno));
-    if (WEXITSTATUS(exit_code) == NO_GIT_BINARY) ERROR("Couldn't find git binary. Make sure it is in PATH.\n");
+static void redirect(posix_spawn_file_actions_t *actions, int fd, int target_fd) {
+    ASSERT(actions != NULL);
 
-    return WEXITSTATUS(exit_code);
+    int error;
+    if (fd == NULL_FD) {
+        int flags = target_fd == STDIN_FILENO ? O_RDONLY : O_WRONLY;
+        error = posix_spawn_file_actions_addopen(actions, target_fd, "/dev/null", flags, 0);
+    } else {
+        error = posix_spawn_file_actions_adddup2(actions, fd, target_fd);
+    }
+    if (error != 0) ERROR("Couldn't set up child's file actions: %s.\n", strerror(error));
 }
 
-char *pipe_read(int fd) {
-    size_t buffer_capacity = INITIAL_BUFFER_SIZE;
-    size_t buffer_size = buffer_capacity;
-    size_t buffer_offset = 0;
+// Spawns git `args` with its standard streams redirected to the given descriptors (NULL_FD means /dev/null).
+// posix_spawn doesn't duplicate parent's page tables like fork does (glibc uses CLONE_VFORK, MacOS has a dedicated syscall),
+// so the cost of spawning doesn't grow with the size of the heap.
+static pid_t spawn_git(char *const *args, int stdin_fd, int stdout_fd, int stderr_fd) {
+    ASSERT(args != NULL);
 
-    char *buffer = (char *) malloc(buffer_capacity + 1);
-    if (buffer == NULL) OUT_OF_MEMORY();
+    posix_spawn_file_actions_t actions;
+    int error = posix_spawn_file_actions_init(&actions);
+    if (error != 0) ERROR("Couldn't initialize child's file actions: %s.\n", strerror(error));
 
-    int bytes;
-    while ((bytes = read(fd, buffer + buffer_offset, buffer_size)) > 0 || (bytes == -1 && errno == EINTR)) {
-        if (bytes == -1) continue;
+    redirect(&actions, stdin_fd, STDIN_FILENO);
+    redirect(&actions, stdout_fd, STDOUT_FILENO);
+    redirect(&actions, stderr_fd, STDERR_FILENO);
 
-        buffer_size -= bytes;
-        buffer_offset += bytes;
+    pthread_once(&git_environ_once, &init_git_environ);
 
-        if (buffer_size == 0) {
-            buffer_size = buffer_capacity;
-            buffer_capacity *= 2;
-            buffer = (char *) realloc(buffer, buffer_capacity + 1);
-            if (buffer == NULL) OUT_OF_MEMORY();
-        }
+    pid_t pid;
+    LOCK_SPAWN();
+    error = posix_spawnp(&pid, "git", &actions, NULL, args, git_environ);
+    UNLOCK_SPAWN();
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (error == ENOENT) ERROR("Couldn't find git binary. Make sure it is in PATH.\n");
+    if (error != 0) ERROR("Couldn't spawn process: %s.\n", strerror(error));
+    return pid;
+}
+
+int gwait(pid_t pid) {
+    int status;
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR) ERROR("Couldn't wait for child process: %s.\n", strerror(errno));
     }
-    if (bytes == -1) {
-        free(buffer);
-        return NULL;
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    return WEXITSTATUS(status);
+}
+
+int gexec(char *const *args) {
+    ASSERT(args != NULL);
+
+    pid_t pid = spawn_git(args, NULL_FD, NULL_FD, NULL_FD);
+    return gwait(pid);
+}
+
+typedef struct {
+    size_t capacity;
+    size_t length;
+    char *data;
+} Buffer;
+
+static void buffer_append(Buffer *buffer, const char *chunk, size_t size) {
+    ASSERT(buffer != NULL && chunk != NULL);
+
+    if (buffer->length + size + 1 > buffer->capacity) {
+        if (buffer->capacity == 0) buffer->capacity = INITIAL_BUFFER_SIZE;
+        while (buffer->length + size + 1 > buffer->capacity) buffer->capacity *= 2;
+
+        buffer->data = (char *) mem_realloc(MEM_GIT_OUTPUT, buffer->data, buffer->capacity);
     }
 
-    buffer[buffer_offset] = '\0';
-    return buffer;
+    memcpy(buffer->data + buffer->length, chunk, size);
+    buffer->length += size;
+    buffer->data[buffer->length] = '\0';
 }
 
-char *gexecr(char *const *args) {
-    ASSERT(args != NULL);
+static void buffer_consumer(const char *chunk, size_t size, void *buffer) { buffer_append((Buffer *) buffer, chunk, size); }
 
-    OPEN_PIPE(read_fd, write_fd);
-    OPEN_PIPE(error_read_fd, error_write_fd);
+typedef struct {
+    const Capture *capture;
+    pid_t pid;
+    Buffer output;
+    Buffer error;
+} Child;
 
-    pid_t pid = fork();
-    if (pid == -1) ERROR("Couldn't fork process: %s.\n", strerror(errno));
-    if (pid == 0) {
-        if (close(read_fd) == -1) exit(1);
-        if (close(error_read_fd) == -1) exit(1);
+void gexecs_all(const Capture *captures, size_t length) {
+    ASSERT(captures != NULL && length > 0);
 
-        if (dup2(write_fd, STDOUT_FILENO) == -1) exit(1);
-        if (dup2(error_write_fd, STDERR_FILENO) == -1) exit(1);
+    Child *children = (Child *) calloc(length, sizeof(Child));
+    struct pollfd *fds = (struct pollfd *) malloc(2 * length * sizeof(struct pollfd));
+    if (children == NULL || fds == NULL) OUT_OF_MEMORY();
 
-        if (execvp("git", args) == -1) exit(errno == ENOENT ? NO_GIT_BINARY : 1);
+    for (size_t i = 0; i < length; i++) {
+        OPEN_PIPE(read_fd, write_fd);
+        OPEN_PIPE(error_read_fd, error_write_fd);
+
+        children[i].capture = &captures[i];
+        children[i].pid = spawn_git(captures[i].args, NULL_FD, write_fd, error_write_fd);
+        if (close(write_fd) == -1 || close(error_write_fd) == -1) ERROR("Couldn't close pipe: %s.\n", strerror(errno));
+
+        buffer_append(&children[i].error, "", 0);
+        if (captures[i].consumer == NULL) buffer_append(&children[i].output, "", 0);
+
+        fds[2 * i] = (struct pollfd){read_fd, POLLIN, 0};
+        fds[2 * i + 1] = (struct pollfd){error_read_fd, POLLIN, 0};
     }
 
-    if (close(write_fd) == -1 || close(error_write_fd) == -1) ERROR("Couldn't close pipe: %s.\n", strerror(errno));
+    // Both pipes of every child are drained at the same time, otherwise child blocks on a full
+    // stderr pipe while we are waiting for the end of its stdout.
+    char chunk[CHUNK_SIZE];
+    size_t running = length;
+    while (running > 0) {
+        if (poll(fds, 2 * length, -1) == -1) {
+            if (errno == EINTR) continue;
+            ERROR("Unable to poll child's pipes: %s.\n", strerror(errno));
+        }
+
+        for (size_t i = 0; i < 2 * length; i++) {
+            if (fds[i].fd == -1 || fds[i].revents == 0) continue;
+
+            Child *child = &children[i / 2];
+            const Capture *capture = child->capture;
+            bool is_stdout = i % 2 == 0;
+
+            ssize_t bytes = read(fds[i].fd, chunk, sizeof(chunk));
+            if (bytes == -1) {
+                if (errno == EINTR) continue;
+                ERROR("Couldn't read from child's pipe: %s.\n", strerror(errno));
+            }
 
-    char *buffer = pipe_read(read_fd);
-    if (buffer == NULL) ERROR("Couldn't read from child's pipe.\n");
+            if (bytes > 0) {
+                if (!is_stdout) buffer_append(&child->error, chunk, bytes);
+                else if (capture->consumer != NULL) capture->consumer(chunk, bytes, capture->arg);
+                else buffer_append(&child->output, chunk, bytes);
+                continue;
+            }
 
-    int exit_code;
-    if (waitpid(pid, &exit_code, 0) == -1) ERROR("Couldn't wait for child process: %s.\n", strerror(errno));
-    if (WEXITSTATUS(exit_code) == NO_GIT_BINARY) ERROR("Couldn't find git binary. Make sure it is in PATH.\n");
-    if (WEXITSTATUS(exit_code) != 0) {
-        char *buffer = pipe_read(error_read_fd);
-        ERROR("Childs process exited with non-zero exit code. Child's stderr:\n%s\n", buffer);
+            if (close(fds[i].fd) == -1) ERROR("Couldn't close pipe: %s.\n", strerror(errno));
+            fds[i].fd = -1;
+            if (fds[i ^ 1].fd != -1) continue;
+
+            // Both pipes are closed, child has either exited or is about to
+            if (gwait(child->pid) != 0) ERROR("Childs process exited with non-zero exit code. Child's stderr:\n%s\n", child->error.data);
+            mem_free(child->error.data);
+            running--;
+
+            if (capture->on_exit != NULL) capture->on_exit(child->output.data, capture->arg);
+            else mem_free(child->output.data);
+        }
     }
 
-    if (close(read_fd) == -1 || close(error_read_fd) == -1) ERROR("Couldn't close pipe: %s.\n", strerror(errno));
-    return buffer;
+    free(fds);
+    free(children);
 }
 
-int gexecw(char *const *args, const char *buffer) {
-    ASSERT(args != NULL && buffer != NULL);
+void gexecs(char *const *args, output_consumer_t *consumer, void *consumer_arg) {
+    ASSERT(args != NULL && consumer != NULL);
 
-    OPEN_PIPE(read_fd, write_fd);
+    Capture capture = {args, consumer, NULL, consumer_arg};
+    gexecs_all(&capture, 1);
+}
 
-    pid_t pid = fork();
-    if (pid == -1) ERROR("Couldn't fork process: %s.\n", strerror(errno));
-    if (pid == 0) {
-        if (close(write_fd) == -1) exit(1);
+char *gexecr(char *const *args) {
+    ASSERT(args != NULL);
 
-        int null_fd = open("/dev/null", O_WRONLY);
-        if (null_fd == -1) exit(1);
-        if (dup2(read_fd, STDIN_FILENO) == -1) exit(1);
-        if (dup2(null_fd, STDOUT_FILENO) == -1) exit(1);
-        if (dup2(null_fd, STDERR_FILENO) == -1) exit(1);
-        close(null_fd);
+    Buffer buffer = {0};
+    buffer_append(&buffer, "", 0);
+    gexecs(args, &buffer_consumer, &buffer);
+    return buffer.data;
+}
 
-        if (execvp("git", args) == -1) exit(1);
-    }
+pid_t gexecp(char *const *args, int *in_fd, int *out_fd) {
+    ASSERT(args != NULL && in_fd != NULL && out_fd != NULL);
+
+    OPEN_PIPE(in_read_fd, in_write_fd);
+    OPEN_PIPE(out_read_fd, out_write_fd);
+
+    pid_t pid = spawn_git(args, in_read_fd, out_write_fd, NULL_FD);
+    if (close(in_read_fd) == -1 || close(out_write_fd) == -1) ERROR("Couldn't close pipe: %s.\n", strerror(errno));
+
+    *in_fd = in_write_fd;
+    *out_fd = out_read_fd;
+    return pid;
+}
+
+int gexecw(char *const *args, const char *buffer) {
+    ASSERT(args != NULL && buffer != NULL);
+
+    OPEN_PIPE(read_fd, write_fd);
 
+    pid_t pid = spawn_git(args, read_fd, NULL_FD, NULL_FD);
     if (close(read_fd) == -1) ERROR("Couldn't close pipe: %s.\n", strerror(errno));
 
     ssize_t patch_size = strlen(buffer);
     if (write(write_fd, buffer, patch_size) != patch_size) ERROR("Couldn't write the entire buffer.\n");
     if (close(write_fd) == -1) ERROR("Couldn't close pipe: %s.\n", strerror(errno));
 
-    int exit_code;
-    if (waitpid(pid, &exit_code, 0) == -1) ERROR("Couldn't wait for child process: %s.\n", strerror(errno));
-    return exit_code;
+    return gwait(pid);
 }
@@ -1,16 +1,48 @@
 #ifndef EXEC_H
 #define EXEC_H
 
+#include <stddef.h>
+#include <sys/types.h>
+
 #define CMD(...) ((char *const[]){__VA_ARGS__, NULL})
 
 // Runs git `args` and returns child's exit code.
 int gexec(char *const *args);
 
-// Runs git `args` and returns malloc()-ed stdout.
+// Receives child's stdout in chunks as soon as they are read.
+typedef void output_consumer_t(const char *chunk, size_t size, void *arg);
+
+// Runs git `args` and passes its stdout to `consumer`. Stderr is collected
+// concurrently and printed in case the child fails.
+void gexecs(char *const *args, output_consumer_t *consumer, void *consumer_arg);
+
+// Called once the child has exited and all of its output was consumed.
+// `output` is stdout allocated with `mem_alloc` when capture has no consumer, NULL otherwise.
+typedef void exit_handler_t(char *output, void *arg);
+
+typedef struct {
+    char *const *args;
+    output_consumer_t *consumer;  // when NULL, stdout is collected and passed to `on_exit`
+    exit_handler_t *on_exit;      // optional
+    void *arg;                    // passed to both callbacks
+} Capture;
+
+// Runs all `captures` at the same time. Handler is called as soon as its child exits,
+// so the output of one can be processed while the others are still running.
+void gexecs_all(const Capture *captures, size_t length);
+
+// Runs git `args` and returns stdout, which must be freed with `mem_free`.
 char *gexecr(char *const *args);
 
 // Runs git `args` and writes `buffer` to its standard input.
 // Returns child's exit code.
 int gexecw(char *const *args, const char *buffer);
 
+// Runs git `args` with pipes connected to its stdin and stdout, which are returned in `in_fd` and `out_fd`.
+// Child's stderr is discarded. Returns child's pid, it must be waited for with `gwait`.
+pid_t gexecp(char *const *args, int *in_fd, int *out_fd);
+
+// Waits for the child and returns its exit code.
+int gwait(pid_t pid);
+
 #endif  // EXEC_H
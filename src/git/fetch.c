@@ -0,0 +1,252 @@
+#define _DEFAULT_SOURCE
+#include "fetch.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "error.h"
+#include "git/catfile.h"
+#include "git/exec.h"
+#include "git/git.h"
+#include "git/state.h"
+#include "memstat.h"
+#include "vector.h"
+
+typedef struct {
+    bool is_staged;
+    bool is_index_blob;  // diff is made of the contents of a created file, which are read from the index
+    char *src;           // malloc()-ed
+    char *dst;           // malloc()-ed
+    char *output;        // diff of the paths, NULL until it is fetched
+} FileFetch;
+
+VECTOR_TYPEDEF(FileFetchVec, FileFetch);
+
+typedef struct {
+    bool is_cancelled;
+    FileFetchVec files;
+} FetchJob;
+
+static int notify_fds[2] = {-1, -1};
+// Job whose diffs will be collected, it is freed by its thread if it gets cancelled
+static FetchJob *current_job = NULL;
+// Files requested while a job is running, they are fetched by the next one
+static FileFetchVec requested = {0};
+
+// Protects the fields below and job's `is_cancelled`
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool is_finished = false;
+
+static void free_files(FileFetchVec *files) {
+    ASSERT(files != NULL);
+
+    for (size_t i = 0; i < files->length; i++) {
+        free(files->data[i].src);
+        free(files->data[i].dst);
+        mem_free(files->data[i].output);
+    }
+    VECTOR_FREE(files);
+}
+
+static void free_job(FetchJob *job) {
+    ASSERT(job != NULL);
+
+    free_files(&job->files);
+    free(job);
+}
+
+static void save_output(char *output, void *dst) {
+    ASSERT(output != NULL && dst != NULL);
+    *(char **) dst = output;
+}
+
+// Reads contents of all created files in one batch, instead of running `git diff` for each of them.
+// Files which are no longer in the index are left for `git diff`.
+static void read_index_blobs(FetchJob *job) {
+    ASSERT(job != NULL);
+
+    str_vec objects = {0};
+    for (size_t i = 0; i < job->files.length; i++) {
+        const FileFetch *file = &job->files.data[i];
+        if (!file->is_index_blob) continue;
+
+        // ":<path>" names the blob at stage 0 of the index
+        char *object = (char *) malloc(strlen(file->dst) + 2);
+        if (object == NULL) OUT_OF_MEMORY();
+        object[0] = ':';
+        strcpy(object + 1, file->dst);
+        VECTOR_PUSH(&objects, object);
+    }
+    if (objects.length == 0) return;
+
+    char **contents = (char **) malloc(objects.length * sizeof(*contents));
+    size_t *sizes = (size_t *) malloc(objects.length * sizeof(*sizes));
+    if (contents == NULL || sizes == NULL) OUT_OF_MEMORY();
+    catfile_read((const char *const *) objects.data, objects.length, contents, sizes);
+
+    size_t j = 0;
+    for (size_t i = 0; i < job->files.length; i++) {
+        FileFetch *file = &job->files.data[i];
+        if (!file->is_index_blob) continue;
+
+        if (contents[j] != NULL) file->output = created_file_diff(file->dst, contents[j], sizes[j]);
+        mem_free(contents[j]);
+        free(objects.data[j]);
+        j++;
+    }
+
+    free(contents);
+    free(sizes);
+    VECTOR_FREE(&objects);
+}
+
+static void *fetch(void *_job) {
+    FetchJob *job = (FetchJob *) _job;
+    ASSERT(job != NULL);
+
+    read_index_blobs(job);
+
+    // one at a time, a whole section might be unfolded at once
+    for (size_t i = 0; i < job->files.length; i++) {
+        FileFetch *file = &job->files.data[i];
+        if (file->output != NULL) continue;
+
+        str_vec command = file_diff_command(file->src, file->dst, file->is_staged);
+        Capture capture = {command.data, NULL, &save_output, &file->output};
+        gexecs_all(&capture, 1);
+        VECTOR_FREE(&command);
+
+        pthread_mutex_lock(&mutex);
+        bool is_cancelled = job->is_cancelled;
+        pthread_mutex_unlock(&mutex);
+        if (is_cancelled) break;
+    }
+
+    pthread_mutex_lock(&mutex);
+    if (job->is_cancelled) {
+        free_job(job);
+    } else {
+        is_finished = true;
+        char byte = 0;
+        if (write(notify_fds[1], &byte, 1) != 1) ERROR("Unable to write to pipe: %s.\n", strerror(errno));
+    }
+    pthread_mutex_unlock(&mutex);
+
+    return NULL;
+}
+
+static void start(void) {
+    ASSERT(current_job == NULL && requested.length > 0);
+
+    FetchJob *job = (FetchJob *) calloc(1, sizeof(FetchJob));
+    if (job == NULL) OUT_OF_MEMORY();
+    job->files = requested;
+    requested = (FileFetchVec){0};
+
+    if (notify_fds[0] == -1) {
+        if (pipe(notify_fds) == -1) ERROR("Unable to create pipe: %s.\n", strerror(errno));
+        int flags = fcntl(notify_fds[0], F_GETFL, 0);
+        if (flags == -1 || fcntl(notify_fds[0], F_SETFL, flags | O_NONBLOCK) == -1)
+            ERROR("Unable to make file description non-blocking: %s.\n", strerror(errno));
+    }
+
+    current_job = job;
+    is_finished = false;
+
+    // cancelled jobs aren't waited for, so the thread isn't joined
+    pthread_t thread;
+    int error = pthread_create(&thread, NULL, &fetch, job);
+    if (error != 0) ERROR("Unable to create diff fetching thread: %s.\n", strerror(error));
+    pthread_detach(thread);
+}
+
+static bool is_requested(const FileFetchVec *files, const File *file, bool is_staged) {
+    ASSERT(files != NULL && file != NULL);
+
+    for (size_t i = 0; i < files->length; i++) {
+        const FileFetch *requested_file = &files->data[i];
+        if (requested_file->is_staged == is_staged && strcmp(requested_file->dst, file->dst) == 0
+            && strcmp(requested_file->src, file->src) == 0)
+            return true;
+    }
+    return false;
+}
+
+void fetch_request(const File *file, bool is_staged) {
+    ASSERT(file != NULL && file->is_summary);
+
+    if (is_requested(&requested, file, is_staged)) return;
+    if (current_job != NULL && is_requested(&current_job->files, file, is_staged)) return;
+
+    // staged diff of a text file that didn't exist before is made of its contents
+    bool is_index_blob = is_staged && file->change_type == FC_CREATED && !file->is_binary && strchr(file->dst, '\n') == NULL;
+    FileFetch request = {is_staged, is_index_blob, strdup(file->src), strdup(file->dst), NULL};
+    if (request.src == NULL || request.dst == NULL) OUT_OF_MEMORY();
+    VECTOR_PUSH(&requested, request);
+
+    if (current_job == NULL) start();
+}
+
+static void drain_pipe(void) {
+    char buffer[64];
+    ssize_t bytes;
+    while ((bytes = read(notify_fds[0], buffer, sizeof(buffer))) > 0) continue;
+    if (bytes == -1 && errno != EAGAIN) ERROR("Unable to read from pipe: %s.\n", strerror(errno));
+}
+
+void fetch_cancel(void) {
+    free_files(&requested);
+    if (current_job == NULL) return;
+
+    pthread_mutex_lock(&mutex);
+    if (is_finished) free_job(current_job);
+    else current_job->is_cancelled = true;
+    current_job = NULL;
+    is_finished = false;
+    pthread_mutex_unlock(&mutex);
+
+    drain_pipe();
+}
+
+int fetch_fd(void) { return current_job == NULL ? -1 : notify_fds[0]; }
+
+static File *find_summary_file(Section *section, const FileFetch *fetched) {
+    ASSERT(section != NULL && fetched != NULL);
+
+    for (size_t i = 0; i < section->files.length; i++) {
+        File *file = &section->files.data[i];
+        if (file->is_summary && strcmp(file->dst, fetched->dst) == 0 && strcmp(file->src, fetched->src) == 0) return file;
+    }
+    return NULL;
+}
+
+bool fetch_collect(State *state) {
+    ASSERT(state != NULL);
+    if (current_job == NULL) return false;
+
+    drain_pipe();
+
+    pthread_mutex_lock(&mutex);
+    bool finished = is_finished;
+    is_finished = false;
+    pthread_mutex_unlock(&mutex);
+    if (!finished) return false;
+
+    FetchJob *job = current_job;
+    current_job = NULL;
+
+    for (size_t i = 0; i < job->files.length; i++) {
+        const FileFetch *fetched = &job->files.data[i];
+        if (fetched->output == NULL) continue;
+
+        Section *section = fetched->is_staged ? &state->staged : &state->unstaged;
+        File *file = find_summary_file(section, fetched);
+        if (file != NULL) set_file_diff(section, file, fetched->output);
+    }
+    free_job(job);
+
+    if (requested.length > 0) start();
+    return true;
+}
@@ -0,0 +1,20 @@
+#ifndef FETCH_H
+#define FETCH_H
+
+#include <ncurses.h>
+#include "git/state.h"
+
+// Files of a big change set are loaded from the summary (see `load_file_diff`). Their diffs are fetched
+// in the background when they are shown, a placeholder is shown meanwhile.
+
+// Requests diff of the summary `file`, unless it has already been requested.
+void fetch_request(const File *file, bool is_staged);
+// Discards running and requested fetches, they would be outdated. Must be called before replacing the state.
+void fetch_cancel(void);
+
+// Descriptor which becomes readable when fetched diffs are ready, -1 if nothing is running.
+int fetch_fd(void);
+// Replaces summary files of `state` with the fetched diffs. Returns whether state has changed.
+bool fetch_collect(State *state);
+
+#endif  // FETCH_H
@@ -1,110 +1,247 @@
+#define _DEFAULT_SOURCE
 #include "git.h"
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include "ctxt.h"
 #include "error.h"
+#include "git/diff.h"
 #include "git/exec.h"
+#include "git/fetch.h"
+#include "git/journal.h"
+#include "git/loader.h"
 #include "git/patch.h"
+#include "git/refresh.h"
+#include "git/renames.h"
+#include "git/staging.h"
+#include "git/status.h"
 #include "git/state.h"
+#include "memstat.h"
 #include "vector.h"
 
 // clang-format off
-static char *const CMD_UNTRACKED[]     = {"git", "ls-files", "--others", "--exclude-standard", NULL};
-static char *const CMD_UNSTAGED[]      = {"git", "diff", NULL};
-static char *const CMD_STAGED[]        = {"git", "diff", "--staged", NULL};
+static char *const CMD_UNSTAGED[] = {"git", "diff", NULL};
+static char *const CMD_STAGED[]   = {"git", "diff", "--staged", NULL};
 
-// "-" means to read from stdin instead of file
-static char *const CMD_APPLY[]         = {"git", "apply", "--cached", "-", NULL};
-static char *const CMD_APPLY_REVERSE[] = {"git", "apply", "--cached", "--reverse", "-", NULL};
+static char *const CMD_UNSTAGED_SUMMARY[] = {"git", "diff", "--raw", "--numstat", "-z", NULL};
+static char *const CMD_STAGED_SUMMARY[]   = {"git", "diff", "--staged", "--raw", "--numstat", "-z", NULL};
 
-static char *const CMD_COUNT_COMMITS[] = {"git", "rev-list", "--count", "--all", NULL};
+static char *const CMD_UNTRACKED[] = {"git", "ls-files", "--others", "--exclude-standard", "-z", NULL};
 // clang-format on
 
-static const char *diff_header_fmt = "diff --git a/%n%*s%n b/%n%*s%n";
+// Above this number of changed paths whole diff is requested instead of passing paths as arguments
+#define MAX_DIFF_PATHSPECS 1024
 
-// Lines are stored as pointers into the text, thus text must be free after lines.
-// It also modifies text by replacing delimiters with nulls.
-static str_vec split(char *text, char delimiter) {
-    ASSERT(text != NULL);
+// Above this number of pairs of created and deleted files diffs are requested without rename
+// detection, created and deleted files are paired into renamed ones in the background
+#define MAX_EAGER_RENAME_PAIRS (128 * 128)
 
-    str_vec lines = {0};
-    char *line_start = text;
-    for (char *ch = text; *ch; ch++) {
-        if (*ch != delimiter) continue;
+// Above this number of changed paths in a section only its summary is loaded,
+// diffs of the files are requested when they are unfolded
+#define MAX_FULL_DIFF_PATHS 2048
 
-        *ch = '\0';
-        VECTOR_PUSH(&lines, line_start);
-        line_start = ch + 1;
+// Open addressing table of indexes into a vector, keyed by hashes of their elements.
+// Elements with equal hashes have to be compared by the caller (see `hash_index_next`).
+typedef struct {
+    uint64_t hash;
+    size_t index;  // index + 1, 0 marks an empty slot
+} HashSlot;
+
+typedef struct {
+    HashSlot *slots;
+    size_t mask;
+} HashIndex;
+
+static void hash_index_init(HashIndex *index, size_t length) {
+    ASSERT(index != NULL);
+
+    // at most half of the slots are used, so that probe sequences stay short
+    size_t capacity = 16;
+    while (capacity < length * 2) capacity *= 2;
+
+    index->slots = (HashSlot *) calloc(capacity, sizeof(*index->slots));
+    if (index->slots == NULL) OUT_OF_MEMORY();
+    index->mask = capacity - 1;
+}
+
+static void hash_index_insert(HashIndex *index, uint64_t hash, size_t i) {
+    ASSERT(index != NULL);
+
+    size_t slot = hash & index->mask;
+    while (index->slots[slot].index != 0) slot = (slot + 1) & index->mask;
+    index->slots[slot] = (HashSlot){hash, i + 1};
+}
+
+// Returns the next index with `hash`, starting from `*slot`, which must be initialized with `hash`.
+// Indexes are returned in the order of insertion. Returns SIZE_MAX if there are no more.
+static size_t hash_index_next(const HashIndex *index, uint64_t hash, size_t *slot) {
+    ASSERT(index != NULL && slot != NULL);
+
+    for (; index->slots[*slot & index->mask].index != 0; (*slot)++) {
+        const HashSlot *entry = &index->slots[*slot & index->mask];
+        if (entry->hash != hash) continue;
+
+        (*slot)++;
+        return entry->index - 1;
     }
-    if (*line_start != '\0') VECTOR_PUSH(&lines, line_start);
+    return SIZE_MAX;
+}
 
-    return lines;
+static void hash_index_free(HashIndex *index) {
+    ASSERT(index != NULL);
+    free(index->slots);
 }
 
-static FileVec parse_diff(char *diff) {
-    ASSERT(diff != NULL);
+static uint64_t hash_path(const char *path) { return fingerprint(path, strlen(path)); }
 
-    str_vec lines = split(diff, '\n');
-    FileVec files = {0};
-    size_t i = 0;
-    while (i < lines.length) {
-        int src_begin = 0, src_end = 0, dst_begin = 0, dst_end = 0;
-        if (sscanf(lines.data[i], diff_header_fmt, &src_begin, &src_end, &dst_begin, &dst_end) != 0 || (src_begin == 0 && src_end == 0))
-            ERROR("Unable to parse file diff header.\n");
+// Whether `path` is one of the `paths` which are in the `index`.
+static bool is_changed_path(const HashIndex *index, const str_vec *paths, const char *path) {
+    ASSERT(index != NULL && paths != NULL && path != NULL);
 
-        File file = {0};
-        file.is_folded = true;
-        file.change_type = FC_MODIFIED;
-        file.src = lines.data[i] + src_begin;
-        lines.data[i][src_end] = '\0';
-        file.dst = lines.data[i] + dst_begin;
-        lines.data[i][dst_end] = '\0';
-
-        i++;
-
-        while (i < lines.length && lines.data[i][0] != '@') {
-            if (strncmp(lines.data[i], "Binary files ", 13) == 0) file.is_binary = true;
-            if (strncmp(lines.data[i], "new file mode", 13) == 0) file.change_type = FC_CREATED;
-            if (strncmp(lines.data[i], "deleted file mode", 17) == 0) file.change_type = FC_DELETED;
-            if (strncmp(lines.data[i], "old mode", 8) == 0) file.old_mode = lines.data[i] + 9;
-            if (strncmp(lines.data[i], "new mode", 8) == 0) file.new_mode = lines.data[i] + 9;
-            if (strncmp(lines.data[i], "--- ", 4) == 0) {
-                if (file.change_type == FC_CREATED) ASSERT(strcmp(lines.data[i] + 4, "/dev/null") == 0);
-                else ASSERT(strcmp(lines.data[i] + 6, file.src) == 0);
-            }
-            if (strncmp(lines.data[i], "+++ ", 4) == 0) {
-                if (file.change_type == FC_DELETED) ASSERT(strcmp(lines.data[i] + 4, "/dev/null") == 0);
-                else ASSERT(strcmp(lines.data[i] + 6, file.dst) == 0);
-            }
-            if (strncmp(lines.data[i], "diff --git", 10) == 0) break;
-            i++;
-        }
-        if (strcmp(file.src, file.dst) != 0) file.change_type = FC_RENAMED;
-
-        while (i < lines.length && lines.data[i][0] == '@') {
-            Hunk hunk = {0};
-            hunk.header = lines.data[i++];
-            while (i < lines.length && lines.data[i][0] != '@' && lines.data[i][0] != 'd') {
-                VECTOR_PUSH(&hunk.lines, lines.data[i]);
-                i++;
-            }
-            VECTOR_PUSH(&file.hunks, hunk);
+    uint64_t hash = hash_path(path);
+    size_t slot = hash, i;
+    while ((i = hash_index_next(index, hash, &slot)) != SIZE_MAX) {
+        if (strcmp(paths->data[i], path) == 0) return true;
+    }
+    return false;
+}
+
+// Paths changed by staging commands since the last update, they are diffed by `update_changed_files`
+static str_vec changed_paths = {0};
+// Index of `changed_paths`, it is rebuilt when it gets half full or paths are removed
+static HashIndex changed_index = {0};
+// State was updated in place, but the rest of it hasn't been checked since then
+static bool is_unverified = false;
+
+typedef struct {
+    size_t index;
+    bool *is_selected;  // flag for every line of the hunk, NULL if the whole hunk is moved
+} MovedHunk;
+
+VECTOR_TYPEDEF(MovedHunkVec, MovedHunk);
+
+// Lines moved by a queued patch. Once it is applied, its file is updated in memory (see `move_selected_lines`),
+// instead of being diffed again, if the state still has the file the lines were selected in.
+typedef struct {
+    bool stage;
+    char *path;
+    uint64_t fingerprint;
+    MovedHunkVec hunks;
+} LineMove;
+
+VECTOR_TYPEDEF(LineMoveVec, LineMove);
+
+static LineMoveVec line_moves = {0};
+// Staging failures which were counted by the last update, moves can't be applied after a new one
+static size_t known_failures = 0;
+
+static void free_line_move(LineMove *move) {
+    ASSERT(move != NULL);
+
+    free(move->path);
+    for (size_t i = 0; i < move->hunks.length; i++) free(move->hunks.data[i].is_selected);
+    VECTOR_FREE(&move->hunks);
+}
+
+static void clear_line_moves(void) {
+    for (size_t i = 0; i < line_moves.length; i++) free_line_move(&line_moves.data[i]);
+    VECTOR_FREE(&line_moves);
+}
+
+static bool has_line_move(const char *path) {
+    ASSERT(path != NULL);
+
+    for (size_t i = 0; i < line_moves.length; i++) {
+        if (strcmp(line_moves.data[i].path, path) == 0) return true;
+    }
+    return false;
+}
+
+static void record_line_move(const File *file, const HunkSelection *selections, size_t length, bool stage) {
+    ASSERT(file != NULL && selections != NULL);
+    if (file->change_type != FC_MODIFIED || strcmp(file->src, file->dst) != 0) return;
+    // file was shown before a whole file operation, which has changed it
+    if (is_path_pending(file->dst) && !has_line_move(file->dst)) return;
+
+    LineMove move = {stage, strdup(file->dst), file->fingerprint, {0}};
+    if (move.path == NULL) OUT_OF_MEMORY();
+    for (size_t i = 0; i < length; i++) {
+        const Hunk *hunk = selections[i].hunk;
+        bool *is_selected = NULL;
+        if (selections[i].is_selected != NULL) {
+            is_selected = (bool *) malloc(hunk->lines_count * sizeof(bool));
+            if (is_selected == NULL) OUT_OF_MEMORY();
+            memcpy(is_selected, selections[i].is_selected, hunk->lines_count * sizeof(bool));
         }
+        VECTOR_PUSH(&move.hunks, ((MovedHunk){hunk - file->hunks.data, is_selected}));
+    }
+    VECTOR_PUSH(&line_moves, move);
+}
 
-        VECTOR_PUSH(&files, file);
+// Drops moves of the `path`, it is changed by a whole file operation after them.
+static void forget_line_moves(const char *path) {
+    ASSERT(path != NULL);
+
+    size_t length = 0;
+    for (size_t i = 0; i < line_moves.length; i++) {
+        if (strcmp(line_moves.data[i].path, path) == 0) free_line_move(&line_moves.data[i]);
+        else line_moves.data[length++] = line_moves.data[i];
     }
+    line_moves.length = length;
+}
 
-    VECTOR_FREE(&lines);
-    return files;
+static void index_changed_paths(void) {
+    hash_index_free(&changed_index);
+    // room for as many more paths, so that the index isn't rebuilt on every insertion
+    hash_index_init(&changed_index, 2 * changed_paths.length);
+    for (size_t i = 0; i < changed_paths.length; i++) hash_index_insert(&changed_index, hash_path(changed_paths.data[i]), i);
+}
+
+static void add_changed_path(const char *path) {
+    ASSERT(path != NULL);
+    if (is_path_pending(path)) return;
+
+    char *copy = strdup(path);
+    if (copy == NULL) OUT_OF_MEMORY();
+    VECTOR_PUSH(&changed_paths, copy);
+
+    if (changed_index.slots == NULL || 2 * changed_paths.length > changed_index.mask + 1) index_changed_paths();
+    else hash_index_insert(&changed_index, hash_path(copy), changed_paths.length - 1);
+}
+
+static void clear_changed_paths(void) {
+    for (size_t i = 0; i < changed_paths.length; i++) free(changed_paths.data[i]);
+    VECTOR_FREE(&changed_paths);
+    hash_index_free(&changed_index);
+    changed_index = (HashIndex){0};
+    clear_line_moves();
+}
+
+static void add_changed_file(const File *file) {
+    ASSERT(file != NULL);
+
+    add_changed_path(file->src);
+    if (strcmp(file->src, file->dst) != 0) add_changed_path(file->dst);
+}
+
+bool is_path_pending(const char *path) {
+    ASSERT(path != NULL);
+    return changed_paths.length > 0 && is_changed_path(&changed_index, &changed_paths, path);
+}
+
+bool is_file_pending(const File *file) {
+    ASSERT(file != NULL);
+    return is_path_pending(file->src) || is_path_pending(file->dst);
 }
 
 // It is possible for the file to get deleted by the time or during this function.
 // Return value indicates whether the `file` was set.
-static bool create_file_from_untracked(File *file, MemoryContext *ctxt, const char *file_path) {
-    ASSERT(ctxt != NULL && file_path != NULL);
+// Text of the file is kept in `section`, which the file is added to.
+static bool create_file_from_untracked(File *file, Section *section, MemoryContext *ctxt, const char *file_path) {
+    ASSERT(section != NULL && ctxt != NULL && file_path != NULL);
 
     struct stat file_info = {0};
     if (stat(file_path, &file_info) == -1) {
@@ -113,17 +250,17 @@ static bool create_file_from_untracked(File *file, MemoryContext *ctxt, const ch
     }
     size_t size = file_info.st_size;
 
-    HunkVec hunks = {0};
-
     size_t length = strlen(file_path);
     char *dst_path = (char *) ctxt_alloc(ctxt, length + 1);
     memcpy(dst_path, file_path, length);
     dst_path[length] = '\0';
 
-    if (size == 0) {
-        *file = (File){true, false, FC_CREATED, dst_path, dst_path, NULL, NULL, hunks};
-        return true;
-    }
+    *file = (File){0};
+    file->is_folded = true;
+    file->change_type = FC_CREATED;
+    file->src = dst_path;
+    file->dst = dst_path;
+    if (size == 0) return true;
 
     int fd = open(file_path, O_RDONLY);
     if (fd == -1) {
@@ -136,101 +273,453 @@ static bool create_file_from_untracked(File *file, MemoryContext *ctxt, const ch
     if (read(fd, buffer, size) != (ssize_t) size) ERROR("Unable to read \"%s\": %s.\n", file_path, strerror((errno)));
     close(fd);
 
+    // every line, including the empty one after the last newline, becomes an added line
+    size_t lines_count = 1;
+    for (char *ch = buffer; (ch = (char *) memchr(ch, '\n', buffer + size - ch)) != NULL; ch++) lines_count++;
+
+    static const char *hunk_header_fmt = "@@ -0,0 +0,%zu @@\n";
+    size_t hunk_header_size = snprintf(NULL, 0, hunk_header_fmt, lines_count);
+    bool has_no_newline = buffer[size - 1] != '\n';
+
+    // Diff text is synthesized, so that the file is stored in the same way as the ones from `git diff`.
+    // Newlines of the file are kept, each line gets '+' and the last one gets '\n'.
+    size_t text_size = hunk_header_size + size + lines_count + 1 + (has_no_newline ? strlen(NO_NEWLINE) + 1 : 0);
+    char *text = (char *) mem_alloc(MEM_UNTRACKED_TEXT, text_size + 1);
+    VECTOR_PUSH(&section->raw, ((TextBlock){text, 0}));
+    char *ptr = text;
+    ptr += snprintf(ptr, hunk_header_size + 1, hunk_header_fmt, lines_count);
+
     size_t offset = 0;
-    str_vec lines = {0};
     for (size_t i = 0; i <= size; i++) {
         if (i < size && buffer[i] != '\n') continue;
 
-        size_t length = i - offset;
-        char *line = (char *) ctxt_alloc(ctxt, 1 + length + 1);
+        *ptr++ = '+';
+        memcpy(ptr, buffer + offset, i - offset);
+        ptr += i - offset;
+        *ptr++ = '\n';
+        offset = i + 1;
+    }
+    free(buffer);
+
+    if (has_no_newline) {
+        memcpy(ptr, NO_NEWLINE, strlen(NO_NEWLINE));
+        ptr += strlen(NO_NEWLINE);
+        *ptr++ = '\n';
+    }
+    ASSERT((size_t) (ptr - text) == text_size);
+    *ptr = '\0';
 
-        line[0] = '+';
-        memcpy(line + 1, buffer + offset, length);
-        line[1 + length] = '\0';
+    file->raw = text;
+    file->raw_length = text_size;
+    file->fingerprint = fingerprint(text, text_size);
 
-        VECTOR_PUSH(&lines, line);
-        offset = i + 1;
+    int exit_code = gexec(CMD("git", "grep", "-I", "--name-only", "--untracked", "-e", ".", "--", dst_path));
+    file->is_binary = exit_code != 0;
+    return true;
+}
+
+typedef struct {
+    Section *section;
+    file_sink_t *sink;
+    void *sink_arg;
+    DiffParser parser;
+} SectionLoad;
+
+static void section_file_handler(File *file, void *_load) {
+    SectionLoad *load = (SectionLoad *) _load;
+    ASSERT(file != NULL && load != NULL);
+
+    load->sink(load->section, file, load->sink_arg);
+}
+
+static FileChange get_raw_change_type(char status) {
+    switch (status) {
+        case 'A': return FC_CREATED;
+        case 'D': return FC_DELETED;
+        case 'R':
+        case 'C': return FC_RENAMED;
+        default: return FC_MODIFIED;
     }
+}
+
+// Parses a line count of numstat entry, binary files have "-" instead of it.
+static char *parse_stat_field(char *field, int *lines, bool *is_binary) {
+    ASSERT(field != NULL && lines != NULL && is_binary != NULL);
 
-    static const char *hunk_header_fmt = "@@ -0,0 +0,%d @@";
-    size_t hunk_header_size = snprintf(NULL, 0, hunk_header_fmt, lines.length);
-    char *hunk_header = (char *) ctxt_alloc(ctxt, hunk_header_size + 1);
-    snprintf(hunk_header, hunk_header_size + 1, hunk_header_fmt, lines.length);
+    char *end = strchr(field, '\t');
+    if (end == NULL) ERROR("Unable to parse git diff summary.\n");
 
-    if (buffer[size - 1] != '\n') {
-        size_t len = strlen(NO_NEWLINE);
+    if (field[0] == '-') *is_binary = true;
+    else *lines = strtol(field, NULL, 10);
+    return end + 1;
+}
+
+// Parses output of `git diff --raw --numstat -z`, which lists raw entries of all files followed by their numstat entries:
+// ":<old mode> <new mode> <old id> <new id> <status>\0<path>\0[<new path>\0]"
+// "<added>\t<deleted>\t<path>\0" or "<added>\t<deleted>\t\0<path>\0<new path>\0"
+static void parse_summary(char *output, SectionLoad *load) {
+    ASSERT(output != NULL && load != NULL);
+
+    FileVec files = {0};
+    char *entry = output;
+    while (*entry == ':') {
+        char *fields[5];
+        fields[0] = entry + 1;
+        for (size_t i = 1; i < 5; i++) {
+            char *space = strchr(fields[i - 1], ' ');
+            if (space == NULL) ERROR("Unable to parse git diff summary.\n");
+            *space = '\0';
+            fields[i] = space + 1;
+        }
+        char *path = fields[4] + strlen(fields[4]) + 1;
+        char *next = path + strlen(path) + 1;
+
+        File file = {0};
+        file.is_folded = true;
+        file.is_summary = true;
+        file.has_stat = true;
+        file.change_type = get_raw_change_type(fields[4][0]);
+        file.src = path;
+        file.dst = path;
+        if (file.change_type == FC_RENAMED) {
+            file.dst = next;
+            next += strlen(next) + 1;
+        }
+        if (file.change_type == FC_MODIFIED && strcmp(fields[0], fields[1]) != 0) {
+            file.old_mode = fields[0];
+            file.new_mode = fields[1];
+        }
 
-        char *line = (char *) ctxt_alloc(ctxt, len);
-        memcpy(line, NO_NEWLINE, len);
-        line[len] = '\0';
-        VECTOR_PUSH(&lines, line);
+        VECTOR_PUSH(&files, file);
+        entry = next;
     }
-    free(buffer);
 
-    Hunk hunk = {0, hunk_header, lines};
-    VECTOR_PUSH(&hunks, hunk);
+    for (size_t i = 0; i < files.length; i++) {
+        File *file = &files.data[i];
 
-    int exit_code = gexec(CMD("git", "grep", "-I", "--name-only", "--untracked", "-e", ".", "--", dst_path));
-    bool is_binary = exit_code != 0;
+        char *path = parse_stat_field(entry, &file->added_lines, &file->is_binary);
+        path = parse_stat_field(path, &file->deleted_lines, &file->is_binary);
+        // renamed file's paths are in separate entries
+        entry = path + strlen(path) + 1;
+        if (path[0] == '\0') {
+            entry += strlen(entry) + 1;
+            entry += strlen(entry) + 1;
+        }
 
-    *file = (File){true, is_binary, FC_CREATED, dst_path, dst_path, NULL, NULL, hunks};
-    return true;
+        load->sink(load->section, file, load->sink_arg);
+    }
+
+    VECTOR_FREE(&files);
+}
+
+static void finish_summary(char *output, void *_load) {
+    SectionLoad *load = (SectionLoad *) _load;
+    ASSERT(output != NULL && load != NULL);
+
+    // files point into the output, so it is kept along with diff blocks
+    mem_recategorize(output, MEM_DIFF_TEXT);
+    VECTOR_PUSH(&load->section->raw, ((TextBlock){output, 0}));
+    parse_summary(output, load);
+}
+
+static void finish_section(char *output, void *parser) {
+    ASSERT(output == NULL && parser != NULL);
+    (void) output;
+
+    diff_parser_finish((DiffParser *) parser);
 }
 
-static void add_untracked_files(MemoryContext *ctxt, FileVec *unstaged) {
-    char *raw_file_paths = gexecr(CMD_UNTRACKED);
-    str_vec untracked_file_paths = split(raw_file_paths, '\n');
+// Returns diff command limited to the changed `paths` if they are given, the vector must be freed.
+static str_vec diff_command(char *const *base_command, const str_vec *paths, bool find_renames) {
+    ASSERT(base_command != NULL);
+
+    str_vec args = {0};
+    bool has_pathspecs = paths != NULL && paths->length <= MAX_DIFF_PATHSPECS;
+
+    VECTOR_PUSH(&args, base_command[0]);
+    // paths are passed as is, without glob matching
+    if (has_pathspecs) VECTOR_PUSH(&args, "--literal-pathspecs");
+    for (size_t i = 1; base_command[i] != NULL; i++) VECTOR_PUSH(&args, base_command[i]);
+    if (!find_renames) VECTOR_PUSH(&args, "--no-renames");
+    if (has_pathspecs) {
+        VECTOR_PUSH(&args, "--");
+        for (size_t i = 0; i < paths->length; i++) VECTOR_PUSH(&args, paths->data[i]);
+    }
+    VECTOR_PUSH(&args, NULL);
+
+    return args;
+}
+
+void load_git_state(State *state, file_sink_t *sink, void *sink_arg) {
+    ASSERT(state != NULL && sink != NULL);
+
+    Status status;
+    get_status(&status);
+
+    str_vec unstaged_paths = {0}, staged_paths = {0};
+    size_t unstaged_created = 0, unstaged_deleted = 0, staged_created = 0, staged_deleted = 0;
+    for (size_t i = 0; i < status.entries.length; i++) {
+        const StatusEntry *entry = &status.entries.data[i];
+
+        // rename source must be included for git to pair it with the destination
+        if (entry->unstaged != STATUS_UNCHANGED) {
+            VECTOR_PUSH(&unstaged_paths, (char *) entry->path);
+            if (entry->orig_path != NULL) VECTOR_PUSH(&unstaged_paths, (char *) entry->orig_path);
+            if (entry->unstaged == 'A') unstaged_created++;
+            if (entry->unstaged == 'D') unstaged_deleted++;
+        }
+        if (entry->staged != STATUS_UNCHANGED) {
+            VECTOR_PUSH(&staged_paths, (char *) entry->path);
+            if (entry->orig_path != NULL) VECTOR_PUSH(&staged_paths, (char *) entry->orig_path);
+            if (entry->staged == 'A') staged_created++;
+            if (entry->staged == 'D') staged_deleted++;
+        }
+    }
+
+    // git compares every created file with every deleted one
+    state->unstaged.is_renames_deferred = unstaged_created * unstaged_deleted > MAX_EAGER_RENAME_PAIRS;
+    state->staged.is_renames_deferred = staged_created * staged_deleted > MAX_EAGER_RENAME_PAIRS;
+
+    bool is_unstaged_summary = unstaged_paths.length > MAX_FULL_DIFF_PATHS;
+    bool is_staged_summary = staged_paths.length > MAX_FULL_DIFF_PATHS;
+    str_vec unstaged_command = diff_command(is_unstaged_summary ? CMD_UNSTAGED_SUMMARY : CMD_UNSTAGED,
+                                            is_unstaged_summary ? NULL : &unstaged_paths, !state->unstaged.is_renames_deferred);
+    str_vec staged_command = diff_command(is_staged_summary ? CMD_STAGED_SUMMARY : CMD_STAGED, is_staged_summary ? NULL : &staged_paths,
+                                          !state->staged.is_renames_deferred);
+
+    SectionLoad unstaged = {&state->unstaged, sink, sink_arg, {0}};
+    SectionLoad staged = {&state->staged, sink, sink_arg, {0}};
+    diff_parser_init(&unstaged.parser, &state->unstaged.raw, &section_file_handler, &unstaged);
+    diff_parser_init(&staged.parser, &state->staged.raw, &section_file_handler, &staged);
+
+    // diffs are parsed while they are being read
+    Capture captures[2];
+    size_t captures_length = 0;
+    if (is_unstaged_summary) {
+        captures[captures_length++] = (Capture){unstaged_command.data, NULL, &finish_summary, &unstaged};
+    } else if (unstaged_paths.length > 0) {
+        captures[captures_length++] = (Capture){unstaged_command.data, &diff_parser_feed, &finish_section, &unstaged.parser};
+    }
+    if (is_staged_summary) {
+        captures[captures_length++] = (Capture){staged_command.data, NULL, &finish_summary, &staged};
+    } else if (staged_paths.length > 0) {
+        captures[captures_length++] = (Capture){staged_command.data, &diff_parser_feed, &finish_section, &staged.parser};
+    }
+    if (captures_length > 0) gexecs_all(captures, captures_length);
+
+    // parsers of summarized sections haven't received anything
+    if (is_unstaged_summary) diff_parser_finish(&unstaged.parser);
+    if (is_staged_summary) diff_parser_finish(&staged.parser);
 
     File file = {0};
-    for (size_t i = 0; i < untracked_file_paths.length; i++) {
-        if (create_file_from_untracked(&file, ctxt, untracked_file_paths.data[i])) VECTOR_PUSH(unstaged, file);
+    for (size_t i = 0; i < status.untracked.length; i++) {
+        if (!create_file_from_untracked(&file, &state->unstaged, &state->ctxt, status.untracked.data[i])) continue;
+        sink(&state->unstaged, &file, sink_arg);
+    }
+
+    VECTOR_FREE(&unstaged_command);
+    VECTOR_FREE(&staged_command);
+    VECTOR_FREE(&unstaged_paths);
+    VECTOR_FREE(&staged_paths);
+    free_status(&status);
+}
+
+typedef struct {
+    File *file;
+    bool is_found;
+} FileDiffLoad;
+
+static void replace_summary_file(File *parsed, void *_load) {
+    FileDiffLoad *load = (FileDiffLoad *) _load;
+    ASSERT(parsed != NULL && load != NULL);
+
+    // without rename detection between the paths, the diff may contain other files too
+    File *file = load->file;
+    if (load->is_found || strcmp(parsed->dst, file->dst) != 0) return;
+    load->is_found = true;
+
+    parsed->is_folded = file->is_folded;
+    parsed->has_stat = file->has_stat;
+    parsed->added_lines = file->added_lines;
+    parsed->deleted_lines = file->deleted_lines;
+    *file = *parsed;
+}
+
+str_vec file_diff_command(const char *src, const char *dst, bool is_staged) {
+    ASSERT(src != NULL && dst != NULL);
+
+    str_vec paths = {0};
+    VECTOR_PUSH(&paths, (char *) dst);
+    if (strcmp(src, dst) != 0) VECTOR_PUSH(&paths, (char *) src);
+    str_vec command = diff_command(is_staged ? CMD_STAGED : CMD_UNSTAGED, &paths, true);
+
+    VECTOR_FREE(&paths);
+    return command;
+}
+
+char *created_file_diff(const char *path, const char *contents, size_t size) {
+    ASSERT(path != NULL && contents != NULL);
+
+    // Mode of the blob isn't known, the parser only needs the line to tell that the file is created.
+    // Like git, empty file has neither the hunk nor the lines with paths.
+    const char *file_header_fmt = size > 0 ? "diff --git a/%s b/%s\nnew file mode 100644\n--- /dev/null\n+++ b/%s\n"
+                                           : "diff --git a/%s b/%s\nnew file mode 100644\n%.0s";
+    size_t file_header_size = snprintf(NULL, 0, file_header_fmt, path, path, path);
+
+    size_t lines_count = 0;
+    for (const char *ch = contents; (ch = (const char *) memchr(ch, '\n', contents + size - ch)) != NULL; ch++) lines_count++;
+    bool has_no_newline = size > 0 && contents[size - 1] != '\n';
+    if (has_no_newline) lines_count++;
+
+    // same as git's, which omits the length of single line ranges and the hunk of an empty file
+    char hunk_header[64] = "";
+    if (lines_count == 1) snprintf(hunk_header, sizeof(hunk_header), "@@ -0,0 +1 @@\n");
+    else if (lines_count > 1) snprintf(hunk_header, sizeof(hunk_header), "@@ -0,0 +1,%zu @@\n", lines_count);
+
+    // each line gets '+', the last one gets '\n' if it has none
+    size_t text_size = file_header_size + strlen(hunk_header) + size + lines_count + (has_no_newline ? 1 + strlen(NO_NEWLINE) + 1 : 0);
+    char *text = (char *) mem_alloc(MEM_GIT_OUTPUT, text_size + 1);
+    char *ptr = text;
+    ptr += snprintf(ptr, file_header_size + 1, file_header_fmt, path, path, path);
+    ptr = stpcpy(ptr, hunk_header);
+
+    const char *line = contents;
+    while (line < contents + size) {
+        const char *newline = (const char *) memchr(line, '\n', contents + size - line);
+        size_t length = newline != NULL ? (size_t) (newline - line) : (size_t) (contents + size - line);
+
+        *ptr++ = '+';
+        memcpy(ptr, line, length);
+        ptr += length;
+        *ptr++ = '\n';
+        line += length + 1;
     }
 
-    VECTOR_FREE(&untracked_file_paths);
-    free(raw_file_paths);
+    if (has_no_newline) ptr = stpcpy(stpcpy(ptr, NO_NEWLINE), "\n");
+    ASSERT((size_t) (ptr - text) == text_size);
+    *ptr = '\0';
+    return text;
+}
+
+void load_file_diff(Section *section, File *file, bool is_staged) {
+    ASSERT(section != NULL && file != NULL);
+    if (!file->is_summary) return;
+
+    str_vec command = file_diff_command(file->src, file->dst, is_staged);
+
+    FileDiffLoad load = {file, false};
+    DiffParser parser;
+    diff_parser_init(&parser, &section->raw, &replace_summary_file, &load);
+    gexecs(command.data, &diff_parser_feed, &parser);
+    diff_parser_finish(&parser);
+
+    // file has no changes anymore, it will be removed by the next update
+    if (!load.is_found) file->is_summary = false;
+
+    VECTOR_FREE(&command);
+}
+
+void set_file_diff(Section *section, File *file, const char *diff) {
+    ASSERT(section != NULL && file != NULL && diff != NULL);
+    if (!file->is_summary) return;
+
+    FileDiffLoad load = {file, false};
+    DiffParser parser;
+    diff_parser_init(&parser, &section->raw, &replace_summary_file, &load);
+    diff_parser_feed(diff, strlen(diff), &parser);
+    diff_parser_finish(&parser);
+
+    if (!load.is_found) file->is_summary = false;
+}
+
+static uint64_t hash_hunk(const Hunk *hunk) {
+    int ranges[] = {hunk->old_start, hunk->old_length, hunk->new_start, hunk->new_length};
+    return fingerprint((const char *) ranges, sizeof(ranges));
+}
+
+static bool is_same_hunk(const Hunk *a, const Hunk *b) {
+    return a->old_start == b->old_start && a->old_length == b->old_length && a->new_start == b->new_start
+           && a->new_length == b->new_length;
 }
 
 static void merge_hunks(const HunkVec *old_hunks, HunkVec *new_hunks) {
+    ASSERT(old_hunks != NULL && new_hunks != NULL);
+
+    HashIndex index;
+    hash_index_init(&index, old_hunks->length);
+    for (size_t i = 0; i < old_hunks->length; i++) hash_index_insert(&index, hash_hunk(&old_hunks->data[i]), i);
+
     for (size_t i = 0; i < new_hunks->length; i++) {
         Hunk *new_hunk = &new_hunks->data[i];
 
-        for (size_t j = 0; j < old_hunks->length; j++) {
+        uint64_t hash = hash_hunk(new_hunk);
+        size_t slot = hash, j;
+        while ((j = hash_index_next(&index, hash, &slot)) != SIZE_MAX) {
             const Hunk *old_hunk = &old_hunks->data[j];
-            if (strcmp(old_hunk->header, new_hunk->header) != 0) continue;
+            if (!is_same_hunk(old_hunk, new_hunk)) continue;
 
             new_hunk->is_folded = old_hunk->is_folded;
             break;
         }
     }
+
+    hash_index_free(&index);
 }
 
-static void merge_files(const FileVec *old_files, FileVec *new_files) {
-    ASSERT(old_files != NULL && new_files != NULL);
+// Copies parsed hunks and line table of `old_file` to `new_file` if its diff hasn't changed.
+// The table is relative to `raw`, so it is valid for the same text in the new block.
+static bool reuse_hunks(const File *old_file, File *new_file, MemoryContext *ctxt) {
+    ASSERT(old_file != NULL && new_file != NULL && ctxt != NULL);
+    if (new_file->line_offsets != NULL || new_file->raw_length != old_file->raw_length) return false;
+    if (new_file->fingerprint != old_file->fingerprint) return false;
+
+    size_t offsets_size = (old_file->lines_count + 1) * sizeof(*old_file->line_offsets);
+    size_t kinds_size = old_file->lines_count * sizeof(*old_file->line_kinds);
+    size_t hunks_size = old_file->hunks.length * sizeof(Hunk);
+
+    new_file->line_offsets = (uint32_t *) memcpy(ctxt_alloc(ctxt, offsets_size), old_file->line_offsets, offsets_size);
+    new_file->line_kinds = (uint8_t *) memcpy(ctxt_alloc(ctxt, kinds_size), old_file->line_kinds, kinds_size);
+    new_file->hunks.data = (Hunk *) memcpy(ctxt_alloc(ctxt, hunks_size), old_file->hunks.data, hunks_size);
+    new_file->hunks.length = old_file->hunks.length;
+    new_file->hunks.capacity = old_file->hunks.length;
+    new_file->lines_count = old_file->lines_count;
+    return true;
+}
+
+// Carries fold state over from `old_files` to files of `new_section`, starting from `first`.
+static void merge_files(const FileVec *old_files, Section *new_section, size_t first, MemoryContext *ctxt) {
+    ASSERT(old_files != NULL && new_section != NULL && ctxt != NULL);
+
+    FileVec *new_files = &new_section->files;
+
+    HashIndex index;
+    hash_index_init(&index, old_files->length);
+    for (size_t i = 0; i < old_files->length; i++) hash_index_insert(&index, hash_path(old_files->data[i].src), i);
 
-    for (size_t i = 0; i < new_files->length; i++) {
+    for (size_t i = first; i < new_files->length; i++) {
         File *new_file = &new_files->data[i];
 
-        for (size_t j = 0; j < old_files->length; j++) {
+        uint64_t hash = hash_path(new_file->src);
+        size_t slot = hash, j;
+        while ((j = hash_index_next(&index, hash, &slot)) != SIZE_MAX) {
             const File *old_file = &old_files->data[j];
             if (strcmp(old_file->src, new_file->src) != 0) continue;
 
             new_file->is_folded = old_file->is_folded;
-            merge_hunks(&old_file->hunks, &new_file->hunks);
+            // hunks are parsed only if they have been shown before, summary files get them once their diff is fetched
+            if (old_file->hunks.length > 0 && !new_file->is_summary) {
+                if (reuse_hunks(old_file, new_file, ctxt)) break;
+
+                load_hunks(new_file, ctxt);
+                merge_hunks(&old_file->hunks, &new_file->hunks);
+            }
             break;
         }
     }
-}
 
-char *get_git_root_path(void) {
-    char *output = gexecr(CMD("git", "rev-parse", "--show-toplevel"));
-    ASSERT(output != NULL);
-    size_t len = strlen(output);
-    if (output[len - 1] == '\n') output[len - 1] = '\0';
-    return output;
+    hash_index_free(&index);
 }
 
-bool is_git_initialized(void) { return gexec(CMD("git", "status")) == 0; }
-
 bool is_state_empty(State *state) {
     ASSERT(state != NULL);
     return state->unstaged.files.length == 0 && state->staged.files.length == 0;
@@ -241,110 +730,334 @@ bool is_ignored(char *file_path) {
     return gexec(CMD("git", "check-ignore", file_path)) == 0;
 }
 
-void get_git_state(State *state) {
+str_vec shown_file_paths(const Section *section) {
+    ASSERT(section != NULL);
+
+    str_vec paths = {0};
+    for (size_t i = 0; i < section->files.length; i++) {
+        const File *file = &section->files.data[i];
+        if (file->hunks.length == 0) continue;
+
+        char *path = strdup(file->src);
+        if (path == NULL) OUT_OF_MEMORY();
+        VECTOR_PUSH(&paths, path);
+    }
+    return paths;
+}
+
+void load_shown_diffs(Section *section, const str_vec *paths, bool is_staged) {
+    ASSERT(section != NULL && paths != NULL);
+    if (paths->length == 0) return;
+
+    HashIndex index;
+    hash_index_init(&index, paths->length);
+    for (size_t i = 0; i < paths->length; i++) hash_index_insert(&index, hash_path(paths->data[i]), i);
+
+    for (size_t i = 0; i < section->files.length; i++) {
+        File *file = &section->files.data[i];
+        if (!file->is_summary) continue;
+
+        uint64_t hash = hash_path(file->src);
+        size_t slot = hash, j;
+        while ((j = hash_index_next(&index, hash, &slot)) != SIZE_MAX) {
+            if (strcmp(paths->data[j], file->src) != 0) continue;
+
+            load_file_diff(section, file, is_staged);
+            break;
+        }
+    }
+
+    hash_index_free(&index);
+}
+
+void replace_git_state(State *state, State *new_state) {
+    ASSERT(state != NULL && new_state != NULL && !is_loading());
+
+    renames_cancel();
+    fetch_cancel();
+
+    new_state->unstaged.is_folded = state->unstaged.is_folded;
+    new_state->staged.is_folded = state->staged.is_folded;
+    merge_files(&state->unstaged.files, &new_state->unstaged, 0, &new_state->ctxt);
+    merge_files(&state->staged.files, &new_state->staged, 0, &new_state->ctxt);
+
+    free_state(state);
+    *state = *new_state;
+
+    renames_start(state);
+}
+
+void forget_changed_files(void) {
+    // paths of queued operations are kept, their changes may not be in the index yet
+    if (staging_pending() == 0) clear_changed_paths();
+    is_unverified = false;
+}
+
+static void collect_file(File *file, void *files) {
+    ASSERT(file != NULL && files != NULL);
+    VECTOR_PUSH((FileVec *) files, *file);
+}
+
+static void keep_output(char *output, void *dst) {
+    ASSERT(output != NULL && dst != NULL);
+    *(char **) dst = output;
+}
+
+// Moves files [from, length) of `files` to `position`.
+static void move_files_to(FileVec *files, size_t from, size_t position) {
+    ASSERT(files != NULL && position <= from && from <= files->length);
+
+    size_t length = files->length - from;
+    if (length == 0 || position == from) return;
+
+    File *moved = (File *) malloc(length * sizeof(*moved));
+    if (moved == NULL) OUT_OF_MEMORY();
+    memcpy(moved, files->data + from, length * sizeof(*moved));
+    memmove(files->data + position + length, files->data + position, (from - position) * sizeof(*moved));
+    memcpy(files->data + position, moved, length * sizeof(*moved));
+    free(moved);
+}
+
+// Replaces files of `section` that have any of the `paths` with `new_files`, keeping their fold state.
+// New files take the place of the replaced ones, or are inserted in path order if there were none.
+static void replace_changed_files(Section *section, MemoryContext *ctxt, const str_vec *paths, const FileVec *new_files) {
+    ASSERT(section != NULL && ctxt != NULL && paths != NULL && new_files != NULL);
+
+    HashIndex index;
+    hash_index_init(&index, paths->length);
+    for (size_t i = 0; i < paths->length; i++) hash_index_insert(&index, hash_path(paths->data[i]), i);
+
+    FileVec *files = &section->files;
+    FileVec old_files = {0};
+    size_t length = 0, position = SIZE_MAX;
+    for (size_t i = 0; i < files->length; i++) {
+        const File *file = &files->data[i];
+        if (is_changed_path(&index, paths, file->src) || is_changed_path(&index, paths, file->dst)) {
+            if (position == SIZE_MAX) position = length;
+            VECTOR_PUSH(&old_files, *file);
+        } else {
+            files->data[length++] = *file;
+        }
+    }
+    files->length = length;
+    hash_index_free(&index);
+
+    for (size_t i = 0; i < new_files->length; i++) CTXT_VECTOR_PUSH(ctxt, files, new_files->data[i]);
+    merge_files(&old_files, section, length, ctxt);
+
+    if (position != SIZE_MAX) {
+        move_files_to(files, length, position);
+    } else {
+        for (size_t i = length; i < files->length; i++) {
+            size_t j = 0;
+            while (j < length && strcmp(files->data[j].dst, files->data[i].dst) < 0) j++;
+            move_files_to(files, i, j);
+            length++;
+        }
+    }
+
+    VECTOR_FREE(&old_files);
+}
+
+static File *find_plain_file(Section *section, const char *path) {
+    ASSERT(section != NULL && path != NULL);
+
+    for (size_t i = 0; i < section->files.length; i++) {
+        File *file = &section->files.data[i];
+        if (strcmp(file->src, path) == 0 && strcmp(file->dst, path) == 0) return file;
+    }
+    return NULL;
+}
+
+// Replaces the file at `path` with the file parsed from `diff`, or removes it if there is no diff.
+static void replace_file_diff(Section *section, MemoryContext *ctxt, const char *path, const char *diff) {
+    ASSERT(section != NULL && ctxt != NULL && path != NULL);
+
+    FileVec files = {0};
+    if (diff != NULL) {
+        DiffParser parser;
+        diff_parser_init(&parser, &section->raw, &collect_file, &files);
+        diff_parser_feed(diff, strlen(diff), &parser);
+        diff_parser_finish(&parser);
+    }
+
+    str_vec paths = {0};
+    VECTOR_PUSH(&paths, (char *) path);
+    replace_changed_files(section, ctxt, &paths, &files);
+
+    VECTOR_FREE(&paths);
+    VECTOR_FREE(&files);
+}
+
+// Updates files of the move in place, if the source section still has the file the lines were selected in.
+// Returns whether the move has been applied.
+static bool apply_line_move(State *state, const LineMove *move) {
+    ASSERT(state != NULL && move != NULL);
+
+    Section *source_section = move->stage ? &state->unstaged : &state->staged;
+    Section *target_section = move->stage ? &state->staged : &state->unstaged;
+    File *source = find_plain_file(source_section, move->path);
+    File *target = find_plain_file(target_section, move->path);
+    if (source == NULL || source->fingerprint != move->fingerprint || source->is_summary) return false;
+    if (target != NULL && target->is_summary) return false;
+
+    load_hunks(source, &state->ctxt);
+    if (target != NULL) load_hunks(target, &state->ctxt);
+
+    HunkSelection *selections = (HunkSelection *) malloc(move->hunks.length * sizeof(*selections));
+    if (selections == NULL) OUT_OF_MEMORY();
+    for (size_t i = 0; i < move->hunks.length; i++) {
+        ASSERT(move->hunks.data[i].index < source->hunks.length);
+        selections[i] = (HunkSelection){&source->hunks.data[move->hunks.data[i].index], move->hunks.data[i].is_selected};
+    }
+
+    char *source_diff, *target_diff;
+    bool is_moved = move_selected_lines(source, target, selections, move->hunks.length, move->stage, &source_diff, &target_diff);
+    free(selections);
+    if (!is_moved) return false;
+
+    replace_file_diff(source_section, &state->ctxt, move->path, source_diff);
+    replace_file_diff(target_section, &state->ctxt, move->path, target_diff);
+    free(source_diff);
+    free(target_diff);
+    return true;
+}
+
+// Applies moves of the finished patches, their paths don't need to be diffed then.
+static void apply_line_moves(State *state) {
     ASSERT(state != NULL);
 
-    state->unstaged.raw = gexecr(CMD_UNSTAGED);
-    state->unstaged.files = parse_diff(state->unstaged.raw);
+    // moves of the failed operation aren't known, the index may have any of them
+    bool has_failed = staging_failures() != known_failures;
+    known_failures = staging_failures();
+
+    // paths are only left out of the diff if all of their moves have been applied
+    str_vec moved_paths = {0}, failed_paths = {0};
+    for (size_t i = 0; i < line_moves.length && !has_failed; i++) {
+        const LineMove *move = &line_moves.data[i];
+        str_vec *paths = apply_line_move(state, move) ? &moved_paths : &failed_paths;
+        VECTOR_PUSH(paths, move->path);
+    }
+
+    size_t length = 0;
+    for (size_t i = 0; i < changed_paths.length; i++) {
+        char *path = changed_paths.data[i];
+        bool is_moved = false;
+        for (size_t j = 0; j < moved_paths.length && !is_moved; j++) is_moved = strcmp(moved_paths.data[j], path) == 0;
+        for (size_t j = 0; j < failed_paths.length && is_moved; j++) is_moved = strcmp(failed_paths.data[j], path) != 0;
 
-    ctxt_init(&state->untracked_ctxt);
-    add_untracked_files(&state->untracked_ctxt, &state->unstaged.files);
+        if (is_moved) free(path);
+        else changed_paths.data[length++] = path;
+    }
+    changed_paths.length = length;
+    index_changed_paths();
 
-    state->staged.raw = gexecr(CMD_STAGED);
-    state->staged.files = parse_diff(state->staged.raw);
+    VECTOR_FREE(&moved_paths);
+    VECTOR_FREE(&failed_paths);
+    clear_line_moves();
 }
 
-void update_git_state(State *state) {
+// Diffs only the changed paths and replaces their files.
+static void diff_changed_files(State *state) {
     ASSERT(state != NULL);
 
-    char *unstaged_raw = gexecr(CMD_UNSTAGED);
-    FileVec unstaged_files = parse_diff(unstaged_raw);
-    MemoryContext new_ctxt;
-    ctxt_init(&new_ctxt);
-    add_untracked_files(&new_ctxt, &unstaged_files);
+    str_vec unstaged_command = diff_command(CMD_UNSTAGED, &changed_paths, true);
+    str_vec staged_command = diff_command(CMD_STAGED, &changed_paths, true);
+    str_vec untracked_command = diff_command(CMD_UNTRACKED, &changed_paths, true);
+
+    // text is stored along with the rest of the section, it is freed by the next full update
+    FileVec unstaged_files = {0}, staged_files = {0};
+    DiffParser unstaged_parser, staged_parser;
+    diff_parser_init(&unstaged_parser, &state->unstaged.raw, &collect_file, &unstaged_files);
+    diff_parser_init(&staged_parser, &state->staged.raw, &collect_file, &staged_files);
+
+    char *untracked = NULL;
+    Capture captures[] = {
+        {unstaged_command.data, &diff_parser_feed, &finish_section, &unstaged_parser},
+        {staged_command.data, &diff_parser_feed, &finish_section, &staged_parser},
+        {untracked_command.data, NULL, &keep_output, &untracked},
+    };
+    gexecs_all(captures, sizeof(captures) / sizeof(captures[0]));
+
+    // unstaged files become untracked
+    File file;
+    for (char *path = untracked; *path != '\0'; path += strlen(path) + 1) {
+        if (create_file_from_untracked(&file, &state->unstaged, &state->ctxt, path)) VECTOR_PUSH(&unstaged_files, file);
+    }
+    mem_free(untracked);
 
-    merge_files(&state->unstaged.files, &unstaged_files);
+    replace_changed_files(&state->unstaged, &state->ctxt, &changed_paths, &unstaged_files);
+    replace_changed_files(&state->staged, &state->ctxt, &changed_paths, &staged_files);
 
-    ctxt_free(&state->untracked_ctxt);
-    state->untracked_ctxt = new_ctxt;
-    free_files(&state->unstaged.files);
-    free(state->unstaged.raw);
-    state->unstaged.files = unstaged_files;
-    state->unstaged.raw = unstaged_raw;
+    VECTOR_FREE(&unstaged_files);
+    VECTOR_FREE(&staged_files);
+    VECTOR_FREE(&unstaged_command);
+    VECTOR_FREE(&staged_command);
+    VECTOR_FREE(&untracked_command);
+}
 
-    char *staged_raw = gexecr(CMD_STAGED);
-    FileVec staged_files = parse_diff(staged_raw);
-    merge_files(&state->staged.files, &staged_files);
-    free_files(&state->staged.files);
-    free(state->staged.raw);
-    state->staged.files = staged_files;
-    state->staged.raw = staged_raw;
+void update_changed_files(State *state) {
+    ASSERT(state != NULL);
+
+    // running refresh doesn't include the changes
+    refresh_cancel();
+
+    // background jobs pair files by their paths, they would see the replaced files, so the whole state is reloaded
+    if (is_loading() || renames_fd() != -1 || changed_paths.length > MAX_DIFF_PATHSPECS) {
+        known_failures = staging_failures();
+        refresh_start(state);
+        return;
+    }
+
+    apply_line_moves(state);
+    if (changed_paths.length > 0) diff_changed_files(state);
+    clear_changed_paths();
+    is_unverified = true;
 }
 
+bool needs_verification(void) { return is_unverified; }
+
 void git_stage_file(const char *file_path) {
     ASSERT(file_path != NULL);
-    if (gexec(CMD("git", "add", (char *) file_path)) != 0) ERROR("Unable to stage file.\n");
+    // recorded changes are staged first, so that the order of operations is kept
+    journal_flush();
+    add_changed_path(file_path);
+    forget_line_moves(file_path);
+    staging_push(SO_STAGE_FILE, file_path, NULL, "file");
 }
 
 void git_unstage_file(const char *file_path) {
     ASSERT(file_path != NULL);
-    if (gexec(CMD("git", "restore", "--staged", (char *) file_path)) == 0) return;
-
-    // There is one valid case when it might fail: there are no commits yet
-    // thus `restore --staged` it fails to restore the file to the last commit
-    // as there isn't any.
-    char *output = gexecr(CMD_COUNT_COMMITS);
-    if (strcmp(output, "0\n") != 0) ERROR("Unable to unstage file.\n");
-    free(output);
-
-    // If this is the case we know that the file wasn't staged before, so we can
-    // safely remove it from the index using `git rm --cached`.
-    // NOTE: `--force` is required for files that are partially staged
-    if (gexec(CMD("git", "rm", "--cached", "--force", (char *) file_path)) != 0) ERROR("Unable to unstage file.\n");
+    journal_flush();
+    add_changed_path(file_path);
+    forget_line_moves(file_path);
+    staging_push(SO_UNSTAGE_FILE, file_path, NULL, "file");
 }
 
 void git_stage_hunk(const File *file, const Hunk *hunk) {
     ASSERT(file != NULL && hunk != NULL);
-
-    char *patch = create_patch_from_hunk(file, hunk, true);
-    if (gexecw(CMD_APPLY, patch) != 0) {
-        DUMP_PATCH(patch);
-        ERROR("Unable to stage the hunk. Failed patch written to \"%s\".\n", FAILED_PATCH_PATH);
-    }
-    free(patch);
+    journal_record_hunk(file, hunk, true);
 }
 
 void git_unstage_hunk(const File *file, const Hunk *hunk) {
     ASSERT(file != NULL && hunk != NULL);
-
-    char *patch = create_patch_from_hunk(file, hunk, false);
-    if (gexecw(CMD_APPLY_REVERSE, patch) != 0) {
-        DUMP_PATCH(patch);
-        ERROR("Unable to unstage the hunk. Failed patch written to \"%s\".\n", FAILED_PATCH_PATH);
-    }
-    free(patch);
+    journal_record_hunk(file, hunk, false);
 }
 
 void git_stage_range(const File *file, const Hunk *hunk, int range_start, int range_end) {
     ASSERT(file != NULL && hunk != NULL);
-
-    char *patch = create_patch_from_range(file, hunk, range_start, range_end, true);
-    if (patch == NULL) return;
-    if (gexecw(CMD_APPLY, patch) != 0) {
-        DUMP_PATCH(patch);
-        ERROR("Unable to stage the range. Failed patch written to \"%s\".\n", FAILED_PATCH_PATH);
-    }
-    free(patch);
+    journal_record_range(file, hunk, range_start, range_end, true);
 }
 
 void git_unstage_range(const File *file, const Hunk *hunk, int range_start, int range_end) {
     ASSERT(file != NULL && hunk != NULL);
+    journal_record_range(file, hunk, range_start, range_end, false);
+}
 
-    char *patch = create_patch_from_range(file, hunk, range_start, range_end, false);
-    if (patch == NULL) return;
-    if (gexecw(CMD_APPLY_REVERSE, patch) != 0) {
-        DUMP_PATCH(patch);
-        ERROR("Unable to unstage the range. Failed patch written to \"%s\".\n", FAILED_PATCH_PATH);
-    }
-    free(patch);
+void git_apply_patch(const File *file, const HunkSelection *selections, size_t length, char *patch, bool stage) {
+    ASSERT(file != NULL && selections != NULL && patch != NULL);
+
+    record_line_move(file, selections, length, stage);
+    add_changed_file(file);
+    staging_push(stage ? SO_APPLY_PATCH : SO_APPLY_REVERSE_PATCH, file->dst, patch, "the changes");
 }
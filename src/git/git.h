@@ -2,18 +2,54 @@
 #define GIT_H
 
 #include <ncurses.h>
+#include "git/patch.h"
 #include "git/state.h"
 
 #define NO_NEWLINE "\\ No newline at end of file"
 
-char *get_git_root_path(void);
-
-bool is_git_initialized(void);
 bool is_state_empty(State *state);
 bool is_ignored(char *file_path);
 
-void get_git_state(State *state);
-void update_git_state(State *state);
+// Receives loaded files, `section` belongs to the state which is being loaded.
+typedef void file_sink_t(Section *section, File *file, void *arg);
+
+// Discovers changed paths with `git status` first, then requests diffs only for them (concurrently),
+// skipping diffs which have no changes at all. Diffs are parsed while being read and every file is
+// passed to `sink` as soon as it is complete.
+void load_git_state(State *state, file_sink_t *sink, void *sink_arg);
+// Replaces `state` with `new_state`, carrying over folds and parsed hunks of the files that remain.
+// Hunks of summary files are carried over only if their diffs are loaded already, see `load_shown_diffs`.
+void replace_git_state(State *state, State *new_state);
+// Returns source paths of the files of `section` whose hunks have been shown, the strings must be freed.
+str_vec shown_file_paths(const Section *section);
+// Loads diffs of the summary files of `section` whose source path is one of `paths`. Runs git, so it is
+// called for a state which is being loaded in the background.
+void load_shown_diffs(Section *section, const str_vec *paths, bool is_staged);
+// Updates files whose lines were moved by the applied patches in memory, with the hunks built by
+// `move_selected_lines`. Diffs only the rest of the paths changed by staging commands since the last update and
+// replaces their files in place, which is much cheaper than a full update in big repositories. Anything else could
+// have changed meanwhile, so the state needs to be verified by a full update later. When the paths can't be diffed
+// on their own, a full update is started in the background instead (see `refresh_start`).
+void update_changed_files(State *state);
+// Whether the path has been changed by a staging command, but its files haven't been updated yet.
+// Such files show the changes from before the command, so they can't be staged again until the update.
+bool is_path_pending(const char *path);
+bool is_file_pending(const File *file);
+bool needs_verification(void);
+// Must be called when a full update starts, it includes every change made before. Paths of queued
+// staging operations are kept until the operations are finished.
+void forget_changed_files(void);
+
+// Requests diff of the `file` that only has a summary and replaces it with the parsed file.
+// Diff text is stored in `section`, which the file belongs to. See `fetch_request` for requesting it in the background.
+void load_file_diff(Section *section, File *file, bool is_staged);
+// Returns command which `load_file_diff` runs for the paths, the vector must be freed. Safe to call from any thread.
+str_vec file_diff_command(const char *src, const char *dst, bool is_staged);
+// Returns diff of a created file at `path` with `contents`, as `git diff` would show it. It is allocated with `mem_alloc`.
+// Safe to call from any thread.
+char *created_file_diff(const char *path, const char *contents, size_t size);
+// Same as `load_file_diff`, with the output of `file_diff_command` which has already been read.
+void set_file_diff(Section *section, File *file, const char *diff);
 
 void git_stage_file(const char *file);
 void git_unstage_file(const char *file);
@@ -24,4 +60,9 @@ void git_unstage_hunk(const File *file, const Hunk *hunk);
 void git_stage_range(const File *file, const Hunk *hunk, int range_start, int range_end);
 void git_unstage_range(const File *file, const Hunk *hunk, int range_start, int range_end);
 
+// Queues `patch` of `file`, which is taken over and is made of the `selections`. Line and hunk operations are
+// recorded in the journal, which calls this when it is flushed. Once the patch is applied, the file is updated
+// in memory if possible, see `update_changed_files`.
+void git_apply_patch(const File *file, const HunkSelection *selections, size_t length, char *patch, bool stage);
+
 #endif  // GIT_H
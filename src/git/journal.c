@@ -0,0 +1,200 @@
+#define _DEFAULT_SOURCE
+#include "journal.h"
+#include <stdlib.h>
+#include <string.h>
+#include "error.h"
+#include "git/git.h"
+#include "git/patch.h"
+#include "git/state.h"
+#include "vector.h"
+
+typedef struct {
+    size_t index;
+    bool *is_selected;  // flag for every line of the hunk
+    bool is_whole;      // recorded by a hunk operation
+} JournalHunk;
+
+VECTOR_TYPEDEF(JournalHunkVec, JournalHunk);
+
+static bool is_recording = false;
+static bool is_staging = false;
+// Copy of the recorded file, which owns its paths, text and line table, so that the patch can be
+// created after the state is updated. Other fields are only used to find the file in the state.
+static File file = {0};
+static JournalHunkVec hunks = {0};
+
+static void *copy(const void *data, size_t size) {
+    ASSERT(data != NULL || size == 0);
+
+    void *result = malloc(size == 0 ? 1 : size);
+    if (result == NULL) OUT_OF_MEMORY();
+    if (size > 0) memcpy(result, data, size);
+    return result;
+}
+
+static void copy_file(const File *src) {
+    ASSERT(src != NULL);
+
+    file = *src;
+    file.src = (const char *) copy(src->src, strlen(src->src) + 1);
+    file.dst = (const char *) copy(src->dst, strlen(src->dst) + 1);
+    file.old_mode = NULL;
+    file.new_mode = NULL;
+    file.raw = (char *) copy(src->raw, src->raw_length);
+    file.line_offsets = (uint32_t *) copy(src->line_offsets, (src->lines_count + 1) * sizeof(*src->line_offsets));
+    file.line_kinds = (uint8_t *) copy(src->line_kinds, src->lines_count * sizeof(*src->line_kinds));
+    file.hunks = (HunkVec){0};
+    VECTOR_RESERVE(&file.hunks, src->hunks.length);
+    for (size_t i = 0; i < src->hunks.length; i++) VECTOR_PUSH(&file.hunks, src->hunks.data[i]);
+}
+
+static void free_file_copy(void) {
+    free((char *) file.src);
+    free((char *) file.dst);
+    free(file.raw);
+    free(file.line_offsets);
+    free(file.line_kinds);
+    VECTOR_FREE(&file.hunks);
+    file = (File){0};
+
+    for (size_t i = 0; i < hunks.length; i++) free(hunks.data[i].is_selected);
+    VECTOR_FREE(&hunks);
+}
+
+// Recorded file may be diffed again while the journal is pending, its new version has the same paths
+static bool is_recorded_path(const File *other, bool stage) {
+    ASSERT(other != NULL);
+
+    return is_recording && is_staging == stage && strcmp(file.src, other->src) == 0 && strcmp(file.dst, other->dst) == 0;
+}
+
+static bool is_recorded_file(const File *other, bool stage) {
+    ASSERT(other != NULL);
+
+    return is_recorded_path(other, stage) && file.fingerprint == other->fingerprint;
+}
+
+// Lines of a hunk are stored next to each other, so hunks are compared with their whole text
+static bool is_same_hunk(const Hunk *hunk, const File *other, const Hunk *other_hunk) {
+    ASSERT(hunk != NULL && other != NULL && other_hunk != NULL);
+    if (hunk->lines_count != other_hunk->lines_count) return false;
+
+    size_t length = file.line_offsets[hunk->first_line + hunk->lines_count] - file.line_offsets[hunk->first_line];
+    size_t other_length = other->line_offsets[other_hunk->first_line + other_hunk->lines_count]
+                          - other->line_offsets[other_hunk->first_line];
+    return length == other_length && memcmp(HUNK_LINE(&file, hunk, 0), HUNK_LINE(other, other_hunk, 0), length) == 0;
+}
+
+static JournalHunk *find_hunk(size_t index) {
+    for (size_t i = 0; i < hunks.length; i++) {
+        if (hunks.data[i].index == index) return &hunks.data[i];
+    }
+    return NULL;
+}
+
+static JournalHunk *record(const File *src, const Hunk *hunk, bool stage) {
+    ASSERT(src != NULL && hunk != NULL);
+    ASSERT(hunk >= src->hunks.data && hunk < src->hunks.data + src->hunks.length);
+
+    if (!is_recorded_file(src, stage)) {
+        journal_flush();
+
+        copy_file(src);
+        is_staging = stage;
+        is_recording = true;
+    }
+
+    size_t index = hunk - src->hunks.data;
+    JournalHunk *journal_hunk = find_hunk(index);
+    if (journal_hunk != NULL) return journal_hunk;
+
+    bool *is_selected = (bool *) calloc(hunk->lines_count, sizeof(bool));
+    if (is_selected == NULL) OUT_OF_MEMORY();
+    VECTOR_PUSH(&hunks, ((JournalHunk){index, is_selected, false}));
+    return &hunks.data[hunks.length - 1];
+}
+
+void journal_record_range(const File *file, const Hunk *hunk, int range_start, int range_end, bool stage) {
+    ASSERT(file != NULL && hunk != NULL);
+
+    // selection may continue past the hunk
+    size_t start = range_start < 0 ? 0 : (size_t) range_start;
+    if (range_end < 0 || start >= hunk->lines_count || range_start > range_end) return;
+    size_t end = (size_t) range_end < hunk->lines_count ? (size_t) range_end : hunk->lines_count - 1;
+
+    JournalHunk *journal_hunk = record(file, hunk, stage);
+    for (size_t i = start; i <= end; i++) journal_hunk->is_selected[i] = true;
+}
+
+void journal_record_hunk(const File *file, const Hunk *hunk, bool stage) {
+    ASSERT(file != NULL && hunk != NULL);
+
+    JournalHunk *journal_hunk = record(file, hunk, stage);
+    for (size_t i = 0; i < hunk->lines_count; i++) journal_hunk->is_selected[i] = true;
+    journal_hunk->is_whole = true;
+}
+
+bool journal_is_empty(void) { return !is_recording; }
+
+const bool *journal_recorded_lines(const File *other, bool is_staged, size_t hunk_index) {
+    ASSERT(other != NULL);
+    if (!is_recorded_path(other, !is_staged)) return NULL;
+
+    if (file.fingerprint == other->fingerprint) {
+        const JournalHunk *journal_hunk = find_hunk(hunk_index);
+        return journal_hunk == NULL ? NULL : journal_hunk->is_selected;
+    }
+
+    // Recorded hunks are found by their text in the new diff, the same index is preferred for repeated ones
+    ASSERT(hunk_index < other->hunks.length);
+    const Hunk *other_hunk = &other->hunks.data[hunk_index];
+    const bool *result = NULL;
+    for (size_t i = 0; i < hunks.length; i++) {
+        const JournalHunk *journal_hunk = &hunks.data[i];
+        if (!is_same_hunk(&file.hunks.data[journal_hunk->index], other, other_hunk)) continue;
+        if (journal_hunk->index == hunk_index) return journal_hunk->is_selected;
+        if (result == NULL) result = journal_hunk->is_selected;
+    }
+    return result;
+}
+
+size_t journal_recorded_count(const File *other, bool is_staged) {
+    ASSERT(other != NULL);
+    if (!is_recorded_path(other, !is_staged)) return 0;
+
+    size_t count = 0;
+    for (size_t i = 0; i < hunks.length; i++) {
+        const Hunk *hunk = &file.hunks.data[hunks.data[i].index];
+        for (size_t j = 0; j < hunk->lines_count; j++) {
+            LineKind kind = HUNK_LINE_KIND(&file, hunk, j);
+            if (hunks.data[i].is_selected[j] && (kind == LK_ADD || kind == LK_DEL)) count++;
+        }
+    }
+    return count;
+}
+
+static int compare_hunks(const void *a, const void *b) {
+    size_t index_a = ((const JournalHunk *) a)->index, index_b = ((const JournalHunk *) b)->index;
+    return (index_a > index_b) - (index_a < index_b);
+}
+
+void journal_flush(void) {
+    if (!is_recording) return;
+    // creating the patch may unstage the file, which flushes the journal
+    is_recording = false;
+
+    qsort(hunks.data, hunks.length, sizeof(*hunks.data), &compare_hunks);
+
+    HunkSelection *selections = (HunkSelection *) malloc(hunks.length * sizeof(*selections));
+    if (selections == NULL) OUT_OF_MEMORY();
+    for (size_t i = 0; i < hunks.length; i++) {
+        const JournalHunk *journal_hunk = &hunks.data[i];
+        selections[i] = (HunkSelection){&file.hunks.data[journal_hunk->index], journal_hunk->is_whole ? NULL : journal_hunk->is_selected};
+    }
+
+    char *patch = create_patch_from_lines(&file, selections, hunks.length, is_staging);
+    if (patch != NULL) git_apply_patch(&file, selections, hunks.length, patch, is_staging);
+
+    free(selections);
+    free_file_copy();
+}
@@ -0,0 +1,29 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <ncurses.h>
+#include <stdlib.h>
+#include "git/state.h"
+
+// Line and hunk (un)staging is recorded in the journal instead of being queued right away. Consecutive
+// operations in the same direction on the same file are merged into a single patch, so that the index
+// is rewritten once. The journal is flushed after a short idle time, on request, before any other
+// (un)staging, and when sagit exits.
+
+// Records lines [range_start, range_end] of `hunk`, the range is clipped to the hunk's lines and nothing is recorded if
+// it doesn't overlap them. Journal of another file is flushed first.
+void journal_record_range(const File *file, const Hunk *hunk, int range_start, int range_end, bool stage);
+void journal_record_hunk(const File *file, const Hunk *hunk, bool stage);
+
+bool journal_is_empty(void);
+// Returns flags of the recorded lines of `file`'s hunk at `hunk_index`, or NULL if none are recorded.
+// `is_staged` is the section of the file, it is the opposite of the recorded direction. If the file has
+// been diffed again since the recording, the flags are of the recorded hunk with the same text.
+const bool *journal_recorded_lines(const File *file, bool is_staged, size_t hunk_index);
+// Returns the number of recorded changed lines of `file`, also after it has been diffed again.
+size_t journal_recorded_count(const File *file, bool is_staged);
+
+// Queues the combined patch and clears the journal.
+void journal_flush(void);
+
+#endif  // JOURNAL_H
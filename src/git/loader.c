@@ -0,0 +1,132 @@
+#include "loader.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include "error.h"
+#include "git/git.h"
+#include "git/renames.h"
+#include "git/state.h"
+#include "vector.h"
+
+static pthread_t thread;
+static bool is_running = false;
+static int notify_fds[2] = {-1, -1};
+
+// Everything below is shared with the loading thread and protected by the mutex
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool is_notified = false;
+static bool is_finished = false;
+static FileVec unstaged_files = {0};
+static FileVec staged_files = {0};
+
+// Owned by the loading thread until it is finished. Files are queued above instead of being stored here.
+static State loaded_state = {0};
+
+// Must be called with locked mutex
+static void notify(void) {
+    if (is_notified) return;
+
+    char byte = 0;
+    if (write(notify_fds[1], &byte, 1) != 1) ERROR("Unable to write to pipe: %s.\n", strerror(errno));
+    is_notified = true;
+}
+
+static void queue_file(Section *section, File *file, void *arg) {
+    ASSERT(section != NULL && file != NULL);
+    (void) arg;
+
+    pthread_mutex_lock(&mutex);
+    if (section == &loaded_state.unstaged) VECTOR_PUSH(&unstaged_files, *file);
+    else VECTOR_PUSH(&staged_files, *file);
+    notify();
+    pthread_mutex_unlock(&mutex);
+}
+
+static void *load(void *arg) {
+    (void) arg;
+
+    load_git_state(&loaded_state, &queue_file, NULL);
+
+    pthread_mutex_lock(&mutex);
+    is_finished = true;
+    notify();
+    pthread_mutex_unlock(&mutex);
+
+    return NULL;
+}
+
+void loader_start(void) {
+    ASSERT(!is_running);
+
+    if (pipe(notify_fds) == -1) ERROR("Unable to create pipe: %s.\n", strerror(errno));
+    int flags = fcntl(notify_fds[0], F_GETFL, 0);
+    if (flags == -1 || fcntl(notify_fds[0], F_SETFL, flags | O_NONBLOCK) == -1)
+        ERROR("Unable to make file description non-blocking: %s.\n", strerror(errno));
+
+    is_finished = false;
+    loaded_state = (State){0};
+    is_running = true;
+
+    int error = pthread_create(&thread, NULL, &load, NULL);
+    if (error != 0) ERROR("Unable to create loading thread: %s.\n", strerror(error));
+}
+
+int loader_fd(void) { return is_running ? notify_fds[0] : -1; }
+
+bool is_loading(void) { return is_running; }
+
+static void move_files(FileVec *src, FileVec *dst, MemoryContext *ctxt) {
+    ASSERT(src != NULL && dst != NULL && ctxt != NULL);
+
+    CTXT_VECTOR_RESERVE(ctxt, dst, dst->length + src->length);
+    for (size_t i = 0; i < src->length; i++) dst->data[dst->length++] = src->data[i];
+    VECTOR_RESET(src);
+}
+
+// Diffs of unfolded summary files may have been added to the sections during loading
+static void move_blocks(TextBlockVec *src, TextBlockVec *dst) {
+    ASSERT(src != NULL && dst != NULL);
+
+    for (size_t i = 0; i < src->length; i++) VECTOR_PUSH(dst, src->data[i]);
+    VECTOR_FREE(src);
+}
+
+bool loader_collect(State *state) {
+    ASSERT(state != NULL);
+    if (!is_running) return false;
+
+    char buffer[64];
+    ssize_t bytes;
+    while ((bytes = read(notify_fds[0], buffer, sizeof(buffer))) > 0) continue;
+    if (bytes == -1 && errno != EAGAIN) ERROR("Unable to read from pipe: %s.\n", strerror(errno));
+
+    pthread_mutex_lock(&mutex);
+    is_notified = false;
+    move_files(&unstaged_files, &state->unstaged.files, &state->ctxt);
+    move_files(&staged_files, &state->staged.files, &state->ctxt);
+    bool finished = is_finished;
+    pthread_mutex_unlock(&mutex);
+
+    if (!finished) return true;
+
+    int error = pthread_join(thread, NULL);
+    if (error != 0) ERROR("Unable to join loading thread: %s.\n", strerror(error));
+
+    // files were already moved, everything they point into is moved now
+    move_blocks(&loaded_state.unstaged.raw, &state->unstaged.raw);
+    move_blocks(&loaded_state.staged.raw, &state->staged.raw);
+    state->unstaged.is_renames_deferred = loaded_state.unstaged.is_renames_deferred;
+    state->staged.is_renames_deferred = loaded_state.staged.is_renames_deferred;
+    ctxt_merge(&state->ctxt, &loaded_state.ctxt);
+
+    VECTOR_FREE(&unstaged_files);
+    VECTOR_FREE(&staged_files);
+    close(notify_fds[0]);
+    close(notify_fds[1]);
+    is_running = false;
+
+    renames_start(state);
+    return true;
+}
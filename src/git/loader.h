@@ -0,0 +1,18 @@
+#ifndef LOADER_H
+#define LOADER_H
+
+#include <ncurses.h>
+#include "git/state.h"
+
+// Loads state on a background thread. Files are handed over as soon as they are
+// parsed, so the first screen can be drawn while git is still producing the diff.
+void loader_start(void);
+
+// Descriptor which becomes readable when there are files to collect, -1 if nothing is loading.
+int loader_fd(void);
+bool is_loading(void);
+
+// Moves loaded files into `state`, which must be empty when loading starts. Returns whether anything has changed.
+bool loader_collect(State *state);
+
+#endif  // LOADER_H
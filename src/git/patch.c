@@ -1,6 +1,8 @@
 #include "patch.h"
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -20,170 +22,478 @@ typedef struct {
     int new_length;
 } HunkHeader;
 
-static HunkHeader parse_hunk_header(const char *raw) {
-    ASSERT(raw != NULL);
+// Writes lines of `selection`'s hunk, applying only the selected changes, and its header to `header`.
+// Returns the end of written lines, or NULL if none of the selected lines is a change.
+static char *write_hunk_lines(char *ptr, const File *file, const HunkSelection *selection, bool stage, HunkHeader *header) {
+    ASSERT(ptr != NULL && file != NULL && selection != NULL && header != NULL);
 
-    HunkHeader header = {-1, -1, -1};
-    int a = 0, b = 0, offset = 0;
+    const Hunk *hunk = selection->hunk;
+    const bool *is_selected = selection->is_selected;
+    ASSERT(hunk->lines_count >= 1);
 
-    if (sscanf(raw, "@@ -%d,%d %n", &a, &b, &offset) == 2) {
-        header.start = a;
-        header.old_length = b;
-    } else if (sscanf(raw, "@@ -%d %n", &a, &offset) == 1) {
-        header.old_length = a;
-    } else ERROR("Unable to parse hunk header: \"%s\".\n", raw);
-
-    if (sscanf(raw + offset, "+%d,%d @@", &a, &b) == 2) {
-        if (header.start == -1) header.start = a;
-        header.new_length = b;
-    } else if (sscanf(raw + offset, "+%d @@", &a) == 1) {
-        header.new_length = a;
-    } else ERROR("Unable to parse hunk header: \"%s\".\n", raw);
-
-    ASSERT(header.start != -1 && header.old_length != -1 && header.new_length != -1);
-    return header;
-}
-
-char *create_patch_from_hunk(const File *file, const Hunk *hunk, bool stage) {
-    ASSERT(file != NULL && hunk != NULL);
-
-    HunkHeader header = parse_hunk_header(hunk->header);
-
-    size_t hunk_length = 0;
-    for (size_t i = 0; i < hunk->lines.length; i++) hunk_length += strlen(hunk->lines.data[i]) + 1;
-
-    const char *src = file->src;
-    if (!stage && file->change_type == FC_RENAMED) src = file->dst;
-
-    size_t file_header_size = snprintf(NULL, 0, file_header_fmt, src, file->dst, src, file->dst);
-    size_t hunk_header_size = snprintf(NULL, 0, hunk_header_fmt, header.start, header.old_length, header.start, header.new_length);
-    char *patch = (char *) malloc(file_header_size + hunk_header_size + hunk_length + 1);
-    if (patch == NULL) OUT_OF_MEMORY();
-
-    char *ptr = patch;
-    ptr += snprintf(ptr, file_header_size + 1, file_header_fmt, src, file->dst, src, file->dst);
-    ptr += snprintf(ptr, hunk_header_size + 1, hunk_header_fmt, header.start, header.old_length, header.start, header.new_length);
-
-    for (size_t i = 0; i < hunk->lines.length; i++) {
-        size_t len = strlen(hunk->lines.data[i]);
-        memcpy(ptr, hunk->lines.data[i], len);
-        ptr += len;
-        *ptr++ = '\n';
-    }
-    *ptr = '\0';
-
-    return patch;
-}
-
-char *create_patch_from_range(const File *file, const Hunk *hunk, size_t range_start, size_t range_end, bool stage) {
-    ASSERT(file != NULL && hunk != NULL);
-    ASSERT(hunk->lines.length >= 1);
-
-    HunkHeader header = parse_hunk_header(hunk->header);
-
-    size_t patch_size = 1;  // space for '\0'
-    for (size_t i = 0; i < hunk->lines.length; i++) patch_size += strlen(hunk->lines.data[i]) + 1;
-    char *patch_body = (char *) malloc(patch_size);
-    if (patch_body == NULL) OUT_OF_MEMORY();
+    *header = (HunkHeader){hunk->old_start, hunk->old_length, hunk->new_length};
 
     bool has_changes = false;
     bool has_unstaged_changes = false;
-    char *ptr = patch_body;
-    for (size_t i = 0; i < hunk->lines.length; i++) {
-        const char *line = hunk->lines.data[i];
+    for (size_t i = 0; i < hunk->lines_count; i++) {
+        LineKind kind = HUNK_LINE_KIND(file, hunk, i);
         bool overwrite_change = false;
 
-        if (range_start <= i && i <= range_end) {
-            if (line[0] == '-' || line[0] == '+') has_changes = true;
+        if (is_selected == NULL || is_selected[i]) {
+            if (kind == LK_DEL || kind == LK_ADD) has_changes = true;
         } else {
-            if (line[0] == '+' || line[0] == '-') has_unstaged_changes = true;
+            if (kind == LK_ADD || kind == LK_DEL) has_unstaged_changes = true;
 
             if (stage) {
-                if (line[0] == '-') {
+                if (kind == LK_DEL) {
                     // prevent it from being applied
                     overwrite_change = true;
-                    header.new_length++;
-                } else if (line[0] == '+') {
+                    header->new_length++;
+                } else if (kind == LK_ADD) {
                     // skip to prevent it from being applied
-                    header.new_length--;
+                    header->new_length--;
                     continue;
                 }
             } else {
-                if (line[0] == '-') {
+                if (kind == LK_DEL) {
                     // skip because it has already been applied
-                    header.old_length--;
+                    header->old_length--;
                     continue;
-                } else if (line[0] == '+') {
+                } else if (kind == LK_ADD) {
                     // "apply", because it has already been applied
                     overwrite_change = true;
-                    header.old_length++;
+                    header->old_length++;
                 }
             }
         }
 
-        size_t len = strlen(line);
-        memcpy(ptr, line, len);
+        size_t len = HUNK_LINE_LENGTH(file, hunk, i);
+        memcpy(ptr, HUNK_LINE(file, hunk, i), len);
         if (overwrite_change) *ptr = ' ';
         ptr += len;
         *ptr++ = '\n';
     }
-    *ptr = '\0';
 
     if (stage) {
         // Handle partial staging of files/hunks with "\ No newline at end of file"
-        if (strcmp(hunk->lines.data[hunk->lines.length - 1], NO_NEWLINE) == 0 && has_unstaged_changes) {
-            ASSERT(hunk->lines.length >= 2);
-            bool is_last_staged = hunk->lines.data[hunk->lines.length - 2][0] == ' ' || range_end >= hunk->lines.length - 2;
-            if (!is_last_staged) *(ptr - strlen(NO_NEWLINE) - 1) = '\0';
+        size_t last = hunk->lines_count - 1;
+        if (HUNK_LINE_KIND(file, hunk, last) == LK_NO_NEWLINE && has_unstaged_changes) {
+            ASSERT(hunk->lines_count >= 2);
+            bool is_last_staged = HUNK_LINE_KIND(file, hunk, last - 1) == LK_CONTEXT || is_selected[last - 1];
+            if (!is_last_staged) ptr -= strlen(NO_NEWLINE) + 1;
         }
     }
 
-    if ((stage && header.new_length == 0) || (!stage && header.old_length == 0)) {
-        // This patch will leave file empty, so we should unstage it
-        git_unstage_file(file->dst);
-        free(patch_body);
-        return NULL;
+    return has_changes ? ptr : NULL;
+}
+
+char *create_patch_from_lines(const File *file, const HunkSelection *selections, size_t length, bool stage) {
+    ASSERT(file != NULL && selections != NULL);
+
+    size_t hunks_size = 0;
+    for (size_t i = 0; i < length; i++) {
+        const Hunk *hunk = selections[i].hunk;
+        for (size_t j = 0; j < hunk->lines_count; j++) hunks_size += HUNK_LINE_LENGTH(file, hunk, j) + 1;
+        // headers are written separately, this is the upper bound of their size
+        hunks_size += snprintf(NULL, 0, hunk_header_fmt, INT_MAX, INT_MAX, INT_MAX, INT_MAX);
     }
 
-    if (!has_changes) {
-        free(patch_body);
+    char *hunks_text = (char *) malloc(hunks_size + 1);
+    char *body = (char *) malloc(hunks_size + 1);
+    if (hunks_text == NULL || body == NULL) OUT_OF_MEMORY();
+
+    // hunks after the first one are shifted by the changes applied before them
+    int offset = 0;
+    bool is_emptied = false;
+    char *ptr = hunks_text;
+    for (size_t i = 0; i < length; i++) {
+        HunkHeader header;
+        char *end = write_hunk_lines(body, file, &selections[i], stage, &header);
+        if (end == NULL) continue;
+
+        // a hunk without lines in the index after unstaging spans the whole file, which is left empty
+        if (!stage && header.old_length == 0) is_emptied = true;
+
+        ptr += sprintf(ptr, hunk_header_fmt, header.start, header.old_length, header.start + offset, header.new_length);
+        memcpy(ptr, body, end - body);
+        ptr += end - body;
+        offset += header.new_length - header.old_length;
+    }
+    *ptr = '\0';
+    free(body);
+
+    if (ptr == hunks_text) {
+        free(hunks_text);
         return NULL;
     }
+    size_t hunks_length = ptr - hunks_text;
+
+    // Unstaging of every line of a created or renamed file removes it from the index, which is done by reverse
+    // applying it as a new file. Its mode is only checked with a warning, so a removed file gets the default one
+    bool is_removed = !stage && is_emptied && (file->change_type == FC_CREATED || file->change_type == FC_RENAMED);
+    struct stat file_info = {.st_mode = 0100644};
+    if (is_removed && stat(file->dst, &file_info) == -1 && errno != ENOENT) {
+        ERROR("Unable to stat \"%s\": %s.\n", file->dst, strerror(errno));
+    }
 
     char *patch;
-    size_t hunk_header_size = snprintf(NULL, 0, hunk_header_fmt, header.start, header.old_length, header.start, header.new_length);
+    if (is_removed) {
+        size_t file_header_size = snprintf(NULL, 0, new_file_header_fmt, file->dst, file->dst, file_info.st_mode, file->dst);
+        patch = (char *) malloc(file_header_size + hunks_length + 1);
+        if (patch == NULL) OUT_OF_MEMORY();
 
-    if (!stage && (file->change_type == FC_CREATED || file->change_type == FC_RENAMED)) {
+        ptr = patch;
+        ptr += snprintf(ptr, file_header_size + 1, new_file_header_fmt, file->dst, file->dst, file_info.st_mode, file->dst);
+    } else if (!stage && (file->change_type == FC_CREATED || file->change_type == FC_RENAMED)) {
         // Unstaging of a created or renamed file requires src == dst
         size_t file_header_size = snprintf(NULL, 0, file_header_fmt, file->dst, file->dst, file->dst, file->dst);
-        patch = (char *) malloc(file_header_size + hunk_header_size + patch_size);
+        patch = (char *) malloc(file_header_size + hunks_length + 1);
         if (patch == NULL) OUT_OF_MEMORY();
 
         ptr = patch;
         ptr += snprintf(ptr, file_header_size + 1, file_header_fmt, file->dst, file->dst, file->dst, file->dst);
     } else if (stage && file->change_type == FC_CREATED) {
         // Staging of a created file requires "new file mode"
-        struct stat file_info = {0};
         if (stat(file->dst, &file_info) == -1) ERROR("Unable to stat \"%s\": %s.\n", file->dst, strerror(errno));
 
         size_t file_header_size = snprintf(NULL, 0, new_file_header_fmt, file->dst, file->dst, file_info.st_mode, file->dst);
-        patch = (char *) malloc(file_header_size + hunk_header_size + patch_size);
+        patch = (char *) malloc(file_header_size + hunks_length + 1);
         if (patch == NULL) OUT_OF_MEMORY();
 
         ptr = patch;
         ptr += snprintf(ptr, file_header_size + 1, new_file_header_fmt, file->dst, file->dst, file_info.st_mode, file->dst);
     } else {
         size_t file_header_size = snprintf(NULL, 0, file_header_fmt, file->src, file->dst, file->src, file->dst);
-        patch = (char *) malloc(file_header_size + hunk_header_size + patch_size);
+        patch = (char *) malloc(file_header_size + hunks_length + 1);
         if (patch == NULL) OUT_OF_MEMORY();
 
         ptr = patch;
         ptr += snprintf(ptr, file_header_size + 1, file_header_fmt, file->src, file->dst, file->src, file->dst);
     }
 
-    ptr += snprintf(ptr, hunk_header_size + 1, hunk_header_fmt, header.start, header.old_length, header.start, header.new_length);
-    memcpy(ptr, patch_body, patch_size);
+    memcpy(ptr, hunks_text, hunks_length + 1);
 
-    free(patch_body);
+    free(hunks_text);
     return patch;
 }
+
+// Lines of context around changes and length limit of function names in hunk headers, same as git's
+#define CONTEXT_LINES 3
+#define FUNC_NAME_SIZE 80
+
+// Line of an updated diff, `text` doesn't include the prefix
+typedef struct {
+    char prefix;
+    const char *text;
+    size_t length;
+} DiffLine;
+
+typedef struct {
+    int old_start;
+    int old_length;
+    int new_start;
+    int new_length;
+    const char *func_name;  // text after the ranges, e.g. "function()" in "@@ -1 +1 @@ function()"
+    size_t func_name_length;
+    size_t first_line;  // index of the first line in `lines` of the diff
+    size_t lines_count;
+} DiffHunk;
+
+VECTOR_TYPEDEF(DiffLineVec, DiffLine);
+VECTOR_TYPEDEF(DiffHunkVec, DiffHunk);
+
+typedef struct {
+    DiffLineVec lines;
+    DiffHunkVec hunks;
+} Diff;
+
+// Ranges of empty hunks start at the line before them
+static int first_line(int start, int length) { return start + (length == 0); }
+static int range_start(int first, int length) { return first - (length == 0); }
+
+static int index_first(const Hunk *hunk, bool is_old) {
+    return is_old ? first_line(hunk->old_start, hunk->old_length) : first_line(hunk->new_start, hunk->new_length);
+}
+
+static int index_length(const Hunk *hunk, bool is_old) { return is_old ? hunk->old_length : hunk->new_length; }
+
+static void get_func_name(const File *file, const Hunk *hunk, const char **func_name, size_t *length) {
+    ASSERT(file != NULL && hunk != NULL && func_name != NULL && length != NULL);
+
+    const char *header = HUNK_HEADER(file, hunk);
+    size_t header_length = HUNK_HEADER_LENGTH(file, hunk);
+    size_t i = sizeof("@@ ") - 1;
+    while (i + 3 <= header_length && strncmp(header + i, " @@", 3) != 0) i++;
+    ASSERT(i + 3 <= header_length);
+
+    i += i + 4 <= header_length ? 4 : 3;
+    *func_name = header + i;
+    *length = header_length - i;
+}
+
+// Finds function name of the hunk which starts at `line` of the `region`, like git's default one: the last
+// line of the old side before the hunk that starts with a letter, '_' or '$'. Returns false if there's none.
+static bool find_func_name(const DiffLineVec *region, size_t line, const char **func_name, size_t *length) {
+    ASSERT(region != NULL && line <= region->length && func_name != NULL && length != NULL);
+
+    while (line-- > 0) {
+        const DiffLine *diff_line = &region->data[line];
+        if (diff_line->prefix == '+' || diff_line->length == 0) continue;
+
+        char first = diff_line->text[0];
+        if (!isalpha((unsigned char) first) && first != '_' && first != '$') continue;
+
+        *length = diff_line->length < FUNC_NAME_SIZE ? diff_line->length : FUNC_NAME_SIZE;
+        while (*length > 0 && isspace((unsigned char) diff_line->text[*length - 1])) (*length)--;
+        *func_name = diff_line->text;
+        return true;
+    }
+    return false;
+}
+
+// Appends `hunk` of `file` as it is, with its ranges moved by the shifts.
+static void copy_hunk(Diff *diff, const File *file, const Hunk *hunk, int old_shift, int new_shift) {
+    ASSERT(diff != NULL && file != NULL && hunk != NULL);
+
+    DiffHunk copy = {hunk->old_start + old_shift, hunk->old_length, hunk->new_start + new_shift, hunk->new_length, NULL, 0,
+                     diff->lines.length, hunk->lines_count};
+    get_func_name(file, hunk, &copy.func_name, &copy.func_name_length);
+    VECTOR_PUSH(&diff->hunks, copy);
+
+    for (size_t i = 0; i < hunk->lines_count; i++) {
+        const char *line = HUNK_LINE(file, hunk, i);
+        VECTOR_PUSH(&diff->lines, ((DiffLine){line[0], line + 1, HUNK_LINE_LENGTH(file, hunk, i) - 1}));
+    }
+}
+
+// Returns prefix of the hunk's line in the section which the changes are moved to (`is_remaining` is false)
+// or in the one they are moved from, 0 if the line isn't there. Both sections share the index, so a line
+// that is in the index and in the other side of the section becomes a context line.
+static char moved_prefix(LineKind kind, bool is_selected, bool stage, bool is_remaining) {
+    if (kind == LK_CONTEXT) return ' ';
+
+    bool is_add = kind == LK_ADD;
+    if (is_remaining) {
+        if (!is_selected) return is_add ? '+' : '-';
+        // staged lines are in the index and worktree, unstaged ones are in neither index nor HEAD
+        if (stage) return is_add ? ' ' : 0;
+        return is_add ? 0 : ' ';
+    }
+
+    if (is_selected) return is_add ? '+' : '-';
+    // lines that are left behind are either kept in both sides of the section or in neither of them
+    if (stage) return is_add ? 0 : ' ';
+    return is_add ? ' ' : 0;
+}
+
+// Returns how many lines the selected changes of the hunk add to the index.
+static int index_change(const File *file, const HunkSelection *selection, bool stage) {
+    ASSERT(file != NULL && selection != NULL);
+
+    int change = 0;
+    for (size_t i = 0; i < selection->hunk->lines_count; i++) {
+        if (selection->is_selected != NULL && !selection->is_selected[i]) continue;
+
+        LineKind kind = HUNK_LINE_KIND(file, selection->hunk, i);
+        if (kind == LK_ADD) change += stage ? 1 : -1;
+        else if (kind == LK_DEL) change += stage ? -1 : 1;
+    }
+    return change;
+}
+
+// Appends hunks made of the lines of `selection`'s hunk as they are after the selected changes are moved,
+// with `CONTEXT_LINES` around the changes like git. `old_first` and `new_first` are numbers of the first line.
+static void add_moved_hunks(Diff *diff, const File *file, const HunkSelection *selection, bool stage, bool is_remaining, int old_first,
+                            int new_first) {
+    ASSERT(diff != NULL && file != NULL && selection != NULL);
+
+    const Hunk *hunk = selection->hunk;
+    DiffLineVec region = {0};
+    for (size_t i = 0; i < hunk->lines_count; i++) {
+        bool is_selected = selection->is_selected == NULL || selection->is_selected[i];
+        char prefix = moved_prefix(HUNK_LINE_KIND(file, hunk, i), is_selected, stage, is_remaining);
+        if (prefix == 0) continue;
+
+        const char *line = HUNK_LINE(file, hunk, i);
+        VECTOR_PUSH(&region, ((DiffLine){prefix, line + 1, HUNK_LINE_LENGTH(file, hunk, i) - 1}));
+    }
+
+    const char *hunk_func_name;
+    size_t hunk_func_name_length;
+    get_func_name(file, hunk, &hunk_func_name, &hunk_func_name_length);
+
+    // lines of the region before `position` on both sides
+    size_t position = 0;
+    int old_before = 0, new_before = 0;
+    while (true) {
+        size_t start = position;
+        while (start < region.length && region.data[start].prefix == ' ') start++;
+        if (start == region.length) break;
+
+        // changes that are at most twice the context apart are in the same hunk
+        size_t last = start;
+        for (size_t i = start + 1; i < region.length && i - last <= 2 * CONTEXT_LINES + 1; i++) {
+            if (region.data[i].prefix != ' ') last = i;
+        }
+        start = start - position > CONTEXT_LINES ? start - CONTEXT_LINES : position;
+        size_t end = region.length - last > CONTEXT_LINES ? last + 1 + CONTEXT_LINES : region.length;
+
+        for (; position < start; position++) {
+            old_before++;
+            new_before++;
+        }
+
+        DiffHunk moved = {0, 0, 0, 0, hunk_func_name, hunk_func_name_length, diff->lines.length, end - start};
+        find_func_name(&region, start, &moved.func_name, &moved.func_name_length);
+        for (; position < end; position++) {
+            const DiffLine *line = &region.data[position];
+            if (line->prefix != '+') moved.old_length++;
+            if (line->prefix != '-') moved.new_length++;
+            VECTOR_PUSH(&diff->lines, *line);
+        }
+        moved.old_start = range_start(old_first + old_before, moved.old_length);
+        moved.new_start = range_start(new_first + new_before, moved.new_length);
+        old_before += moved.old_length;
+        new_before += moved.new_length;
+        VECTOR_PUSH(&diff->hunks, moved);
+    }
+
+    VECTOR_FREE(&region);
+}
+
+static int format_range(char *buffer, size_t size, char sign, int start, int length) {
+    // single line ranges have no length, like in git's output
+    if (length == 1) return snprintf(buffer, size, "%c%d", sign, start);
+    return snprintf(buffer, size, "%c%d,%d", sign, start, length);
+}
+
+// Returns section of the diff with `diff`'s hunks, or NULL if there are none. It must be freed.
+static char *write_diff(const char *path, const Diff *diff) {
+    ASSERT(path != NULL && diff != NULL);
+    if (diff->hunks.length == 0) return NULL;
+
+    size_t size = snprintf(NULL, 0, file_header_fmt, path, path, path, path);
+    for (size_t i = 0; i < diff->hunks.length; i++) {
+        const DiffHunk *hunk = &diff->hunks.data[i];
+        size += sizeof("@@ ") - 1 + format_range(NULL, 0, '-', hunk->old_start, hunk->old_length) + 1
+                + format_range(NULL, 0, '+', hunk->new_start, hunk->new_length) + sizeof(" @@") - 1
+                + (hunk->func_name_length > 0 ? 1 + hunk->func_name_length : 0) + 1;
+    }
+    for (size_t i = 0; i < diff->lines.length; i++) size += 1 + diff->lines.data[i].length + 1;
+
+    char *text = (char *) malloc(size + 1);
+    if (text == NULL) OUT_OF_MEMORY();
+
+    char *ptr = text;
+    ptr += sprintf(ptr, file_header_fmt, path, path, path, path);
+    for (size_t i = 0; i < diff->hunks.length; i++) {
+        const DiffHunk *hunk = &diff->hunks.data[i];
+        ptr += sprintf(ptr, "@@ ");
+        ptr += format_range(ptr, size + 1 - (ptr - text), '-', hunk->old_start, hunk->old_length);
+        *ptr++ = ' ';
+        ptr += format_range(ptr, size + 1 - (ptr - text), '+', hunk->new_start, hunk->new_length);
+        ptr += sprintf(ptr, " @@");
+        if (hunk->func_name_length > 0) {
+            *ptr++ = ' ';
+            memcpy(ptr, hunk->func_name, hunk->func_name_length);
+            ptr += hunk->func_name_length;
+        }
+        *ptr++ = '\n';
+
+        for (size_t j = hunk->first_line; j < hunk->first_line + hunk->lines_count; j++) {
+            const DiffLine *line = &diff->lines.data[j];
+            *ptr++ = line->prefix;
+            memcpy(ptr, line->text, line->length);
+            ptr += line->length;
+            *ptr++ = '\n';
+        }
+    }
+    ASSERT((size_t) (ptr - text) == size);
+    *ptr = '\0';
+
+    return text;
+}
+
+static bool is_plain_file(const File *file) {
+    return file->change_type == FC_MODIFIED && !file->is_binary && !file->is_summary && file->old_mode == NULL
+           && strcmp(file->src, file->dst) == 0;
+}
+
+bool move_selected_lines(const File *source, const File *target, const HunkSelection *selections, size_t length, bool stage,
+                         char **source_diff, char **target_diff) {
+    ASSERT(source != NULL && selections != NULL && source_diff != NULL && target_diff != NULL);
+    if (!is_plain_file(source) || (target != NULL && !is_plain_file(target))) return false;
+
+    // index is the old side of unstaged diff and the new side of the staged one
+    bool is_source_index_old = stage, is_target_index_old = !stage;
+
+    for (size_t i = 0; i < length; i++) {
+        const Hunk *hunk = selections[i].hunk;
+        ASSERT(hunk >= source->hunks.data && hunk < source->hunks.data + source->hunks.length);
+        ASSERT(i == 0 || selections[i - 1].hunk < hunk);
+        for (size_t j = 0; j < hunk->lines_count; j++) {
+            if (HUNK_LINE_KIND(source, hunk, j) == LK_NO_NEWLINE) return false;
+        }
+
+        // hunks of both sections which are closer than a line would be merged by git
+        int first = index_first(hunk, is_source_index_old), end = first + index_length(hunk, is_source_index_old);
+        if (first == end) return false;
+        for (size_t j = 0; target != NULL && j < target->hunks.length; j++) {
+            const Hunk *target_hunk = &target->hunks.data[j];
+            int target_first = index_first(target_hunk, is_target_index_old);
+            int target_end = target_first + index_length(target_hunk, is_target_index_old);
+            if (target_first == target_end || (end >= target_first && target_end >= first)) return false;
+        }
+    }
+
+    // Hunks that are left in the source are shifted by the changes of the index before them
+    Diff remaining = {0};
+    int shift = 0;
+    for (size_t i = 0, k = 0; i < source->hunks.length; i++) {
+        const Hunk *hunk = &source->hunks.data[i];
+        if (k == length || selections[k].hunk != hunk) {
+            copy_hunk(&remaining, source, hunk, stage ? shift : 0, stage ? 0 : shift);
+            continue;
+        }
+
+        const HunkSelection *selection = &selections[k++];
+        int old_first = first_line(hunk->old_start, hunk->old_length) + (stage ? shift : 0);
+        int new_first = first_line(hunk->new_start, hunk->new_length) + (stage ? 0 : shift);
+        add_moved_hunks(&remaining, source, selection, stage, true, old_first, new_first);
+        shift += index_change(source, selection, stage);
+    }
+
+    // Moved hunks are put between hunks of the target in the order of the index. Other side of the target
+    // is `offset` lines ahead of the index at that point.
+    Diff moved = {0};
+    shift = 0;
+    int offset = 0;
+    size_t target_length = target == NULL ? 0 : target->hunks.length;
+    for (size_t i = 0, k = 0; i < target_length || k < length;) {
+        const Hunk *target_hunk = i < target_length ? &target->hunks.data[i] : NULL;
+        const Hunk *source_hunk = k < length ? selections[k].hunk : NULL;
+        if (source_hunk == NULL
+            || (target_hunk != NULL && index_first(target_hunk, is_target_index_old) < index_first(source_hunk, is_source_index_old))) {
+            copy_hunk(&moved, target, target_hunk, stage ? 0 : shift, stage ? shift : 0);
+            offset += index_length(target_hunk, !is_target_index_old) - index_length(target_hunk, is_target_index_old);
+            i++;
+            continue;
+        }
+
+        const HunkSelection *selection = &selections[k++];
+        int first = index_first(source_hunk, is_source_index_old);
+        int old_first = stage ? first + offset : first + shift;
+        int new_first = stage ? first + shift : first + offset;
+        add_moved_hunks(&moved, source, selection, stage, false, old_first, new_first);
+        shift += index_change(source, selection, stage);
+    }
+
+    *source_diff = write_diff(source->dst, &remaining);
+    *target_diff = write_diff(source->dst, &moved);
+
+    VECTOR_FREE(&remaining.lines);
+    VECTOR_FREE(&remaining.hunks);
+    VECTOR_FREE(&moved.lines);
+    VECTOR_FREE(&moved.hunks);
+    return true;
+}
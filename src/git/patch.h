@@ -17,8 +17,22 @@
         close(fd);                                                            \
     } while (0);
 
-char *create_patch_from_hunk(const File *file, const Hunk *hunk, bool stage);
+typedef struct {
+    const Hunk *hunk;
+    const bool *is_selected;  // flag for every line of the hunk, NULL if the whole hunk is selected
+} HunkSelection;
+
+// Creates a single patch of the selected lines of `file`'s hunks, which must be in order.
 // Returns NULL in case patch doesn't contain any changes or doesn't need to be applied
-char *create_patch_from_range(const File *file, const Hunk *hunk, size_t range_start, size_t range_end, bool stage);
+char *create_patch_from_lines(const File *file, const HunkSelection *selections, size_t length, bool stage);
+
+// Builds diffs of the `source` file and of the `target` file with the same path in the other section (NULL if there
+// is none), as they are after the selected lines are (un)staged. Diffs are malloc()-ed, NULL if there are no
+// changes left. Hunks of both diffs have context like git's, but they may be aligned differently or have other
+// function names in their headers, so they are only used until the next full update. Returns false if the result
+// can't be told without diffing again: files aren't plainly modified, or the moved hunks would be merged with the
+// target's ones.
+bool move_selected_lines(const File *source, const File *target, const HunkSelection *selections, size_t length, bool stage,
+                         char **source_diff, char **target_diff);
 
 #endif  //  PATCH
@@ -0,0 +1,174 @@
+#include "refresh.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "error.h"
+#include "git/git.h"
+#include "git/loader.h"
+#include "git/state.h"
+#include "vector.h"
+
+static int notify_fds[2] = {-1, -1};
+// Only used by the main thread
+static bool is_running = false;
+static bool is_waiting = false;  // whether there is a requested state to collect
+
+// Everything below is shared with the refresh thread and protected by the mutex
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t is_requested_cond = PTHREAD_COND_INITIALIZER;
+static bool is_requested = false;
+// Incremented by every start and cancel, a state loaded for an older request is discarded
+static size_t generation = 0;
+static bool is_loaded = false;
+static State loaded = {0};
+// Source paths of the files whose hunks were shown when the refresh was requested (see `shown_file_paths`)
+static str_vec unstaged_shown = {0};
+static str_vec staged_shown = {0};
+
+static void free_paths(str_vec *paths) {
+    ASSERT(paths != NULL);
+
+    for (size_t i = 0; i < paths->length; i++) free(paths->data[i]);
+    VECTOR_FREE(paths);
+}
+
+static void store_file(Section *section, File *file, void *ctxt) {
+    ASSERT(section != NULL && file != NULL && ctxt != NULL);
+    CTXT_VECTOR_PUSH((MemoryContext *) ctxt, &section->files, *file);
+}
+
+static void *serve(void *arg) {
+    (void) arg;
+
+    pthread_mutex_lock(&mutex);
+    while (true) {
+        while (!is_requested) pthread_cond_wait(&is_requested_cond, &mutex);
+        is_requested = false;
+        size_t load_generation = generation;
+        str_vec unstaged_paths = unstaged_shown, staged_paths = staged_shown;
+        unstaged_shown = (str_vec){0};
+        staged_shown = (str_vec){0};
+        pthread_mutex_unlock(&mutex);
+
+        State state = {0};
+        load_git_state(&state, &store_file, &state.ctxt);
+        // shown files of a summary would otherwise lose their hunks, or have to be diffed on the main thread
+        load_shown_diffs(&state.unstaged, &unstaged_paths, false);
+        load_shown_diffs(&state.staged, &staged_paths, true);
+        free_paths(&unstaged_paths);
+        free_paths(&staged_paths);
+
+        pthread_mutex_lock(&mutex);
+        // requests made during the load are served by loading again
+        if (load_generation != generation) {
+            pthread_mutex_unlock(&mutex);
+            free_state(&state);
+            pthread_mutex_lock(&mutex);
+            continue;
+        }
+
+        ASSERT(!is_loaded);
+        loaded = state;
+        is_loaded = true;
+        char byte = 0;
+        if (write(notify_fds[1], &byte, 1) != 1) ERROR("Unable to write to pipe: %s.\n", strerror(errno));
+    }
+
+    return NULL;
+}
+
+static void start(void) {
+    ASSERT(!is_running);
+
+    if (pipe(notify_fds) == -1) ERROR("Unable to create pipe: %s.\n", strerror(errno));
+    int flags = fcntl(notify_fds[0], F_GETFL, 0);
+    if (flags == -1 || fcntl(notify_fds[0], F_SETFL, flags | O_NONBLOCK) == -1)
+        ERROR("Unable to make file description non-blocking: %s.\n", strerror(errno));
+
+    is_running = true;
+    // thread lives until sagit exits, there is nothing to finish, so it isn't joined
+    pthread_t thread;
+    int error = pthread_create(&thread, NULL, &serve, NULL);
+    if (error != 0) ERROR("Unable to create refresh thread: %s.\n", strerror(error));
+    pthread_detach(thread);
+}
+
+static void drain_pipe(void) {
+    char buffer[64];
+    ssize_t bytes;
+    while ((bytes = read(notify_fds[0], buffer, sizeof(buffer))) > 0) continue;
+    if (bytes == -1 && errno != EAGAIN) ERROR("Unable to read from pipe: %s.\n", strerror(errno));
+}
+
+// Invalidates loads in progress and takes the loaded state, if any. Must be called with the mutex locked.
+static State discard_loaded(void) {
+    generation++;
+    // pipe is drained under the mutex, so that notification of a newer load isn't lost
+    drain_pipe();
+
+    State state = {0};
+    if (is_loaded) state = loaded;
+    is_loaded = false;
+    return state;
+}
+
+void refresh_start(const State *state) {
+    ASSERT(state != NULL);
+
+    // the new state includes all of the changes made so far
+    forget_changed_files();
+    if (!is_running) start();
+
+    str_vec unstaged_paths = shown_file_paths(&state->unstaged);
+    str_vec staged_paths = shown_file_paths(&state->staged);
+
+    pthread_mutex_lock(&mutex);
+    State outdated = discard_loaded();
+    is_requested = true;
+    // paths of a request which hasn't been taken yet are replaced
+    str_vec unstaged_outdated = unstaged_shown, staged_outdated = staged_shown;
+    unstaged_shown = unstaged_paths;
+    staged_shown = staged_paths;
+    pthread_cond_signal(&is_requested_cond);
+    pthread_mutex_unlock(&mutex);
+
+    free_state(&outdated);
+    free_paths(&unstaged_outdated);
+    free_paths(&staged_outdated);
+    is_waiting = true;
+}
+
+void refresh_cancel(void) {
+    if (!is_waiting) return;
+
+    pthread_mutex_lock(&mutex);
+    State outdated = discard_loaded();
+    is_requested = false;
+    pthread_mutex_unlock(&mutex);
+
+    free_state(&outdated);
+    is_waiting = false;
+}
+
+// initial load must be collected first, so that its files aren't mixed with the new ones
+int refresh_fd(void) { return !is_waiting || is_loading() ? -1 : notify_fds[0]; }
+
+bool refresh_collect(State *state) {
+    ASSERT(state != NULL);
+    if (!is_waiting || is_loading()) return false;
+
+    pthread_mutex_lock(&mutex);
+    drain_pipe();
+    bool has_loaded = is_loaded;
+    State new_state = loaded;
+    is_loaded = false;
+    pthread_mutex_unlock(&mutex);
+    if (!has_loaded) return false;
+
+    is_waiting = false;
+    replace_git_state(state, &new_state);
+    return true;
+}
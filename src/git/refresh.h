@@ -0,0 +1,21 @@
+#ifndef REFRESH_H
+#define REFRESH_H
+
+#include <ncurses.h>
+#include "git/state.h"
+
+// Full updates are loaded into a separate state on a background thread, while the current one
+// stays on the screen. When it is ready, the new state replaces the current one.
+
+// Starts loading a new state. Running refresh is cancelled, its state would be outdated.
+// Diffs of the files of `state` whose hunks are shown are loaded too, if they are in a summary.
+void refresh_start(const State *state);
+// Discards running refresh. Must be called when the index is changed by sagit itself.
+void refresh_cancel(void);
+
+// Descriptor which becomes readable when the new state is ready, -1 if there is nothing to collect.
+int refresh_fd(void);
+// Replaces `state` with the loaded one, keeping its folds. Returns whether state has changed.
+bool refresh_collect(State *state);
+
+#endif  // REFRESH_H
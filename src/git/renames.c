@@ -0,0 +1,277 @@
+#define _DEFAULT_SOURCE
+#include "renames.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "error.h"
+#include "git/exec.h"
+#include "git/state.h"
+#include "memstat.h"
+#include "vector.h"
+
+// clang-format off
+static char *const CMD_UNSTAGED_RENAMES[] = {"git", "diff", "--find-renames", "--name-status", "-z", NULL};
+static char *const CMD_STAGED_RENAMES[]   = {"git", "diff", "--staged", "--find-renames", "--name-status", "-z", NULL};
+// clang-format on
+
+// Above this number of paths whole diff is requested instead of passing paths as arguments
+#define MAX_RENAME_PATHSPECS 1024
+
+// Index of sections in a job
+#define UNSTAGED 0
+#define STAGED 1
+
+typedef struct {
+    bool is_cancelled;
+    str_vec paths[2];  // malloc()-ed paths of created and deleted files
+    char *outputs[2];  // `git diff --name-status` of sections, NULL if detection wasn't needed
+} RenameJob;
+
+typedef struct {
+    const char *path;
+    size_t index;
+} PathIndex;
+
+VECTOR_TYPEDEF(PathIndexVec, PathIndex);
+
+static int notify_fds[2] = {-1, -1};
+// Job whose results will be collected, it is freed by its thread if it gets cancelled
+static RenameJob *current_job = NULL;
+
+// Protects the fields below and job's `is_cancelled`
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool is_finished = false;
+
+static void free_job(RenameJob *job) {
+    ASSERT(job != NULL);
+
+    for (size_t i = 0; i < 2; i++) {
+        for (size_t j = 0; j < job->paths[i].length; j++) free(job->paths[i].data[j]);
+        VECTOR_FREE(&job->paths[i]);
+        mem_free(job->outputs[i]);
+    }
+    free(job);
+}
+
+static void save_output(char *output, void *dst) {
+    ASSERT(output != NULL && dst != NULL);
+    *(char **) dst = output;
+}
+
+// Returns command limited to `paths`, the vector must be freed.
+static str_vec rename_command(char *const *base_command, const str_vec *paths) {
+    ASSERT(base_command != NULL && paths != NULL);
+
+    str_vec args = {0};
+    bool has_pathspecs = paths->length <= MAX_RENAME_PATHSPECS;
+
+    VECTOR_PUSH(&args, base_command[0]);
+    if (has_pathspecs) VECTOR_PUSH(&args, "--literal-pathspecs");
+    for (size_t i = 1; base_command[i] != NULL; i++) VECTOR_PUSH(&args, base_command[i]);
+    if (has_pathspecs) {
+        VECTOR_PUSH(&args, "--");
+        for (size_t i = 0; i < paths->length; i++) VECTOR_PUSH(&args, paths->data[i]);
+    }
+    VECTOR_PUSH(&args, NULL);
+
+    return args;
+}
+
+static void *detect_renames(void *_job) {
+    RenameJob *job = (RenameJob *) _job;
+    ASSERT(job != NULL);
+
+    str_vec commands[2] = {0};
+    Capture captures[2];
+    size_t captures_length = 0;
+    for (size_t i = 0; i < 2; i++) {
+        if (job->paths[i].length == 0) continue;
+
+        commands[i] = rename_command(i == STAGED ? CMD_STAGED_RENAMES : CMD_UNSTAGED_RENAMES, &job->paths[i]);
+        captures[captures_length++] = (Capture){commands[i].data, NULL, &save_output, &job->outputs[i]};
+    }
+    gexecs_all(captures, captures_length);
+
+    for (size_t i = 0; i < 2; i++) VECTOR_FREE(&commands[i]);
+
+    pthread_mutex_lock(&mutex);
+    if (job->is_cancelled) {
+        free_job(job);
+    } else {
+        is_finished = true;
+        char byte = 0;
+        if (write(notify_fds[1], &byte, 1) != 1) ERROR("Unable to write to pipe: %s.\n", strerror(errno));
+    }
+    pthread_mutex_unlock(&mutex);
+
+    return NULL;
+}
+
+static void collect_paths(const Section *section, str_vec *paths) {
+    ASSERT(section != NULL && paths != NULL);
+    if (!section->is_renames_deferred) return;
+
+    for (size_t i = 0; i < section->files.length; i++) {
+        const File *file = &section->files.data[i];
+        if (file->change_type != FC_CREATED && file->change_type != FC_DELETED) continue;
+
+        char *path = strdup(file->dst);
+        if (path == NULL) OUT_OF_MEMORY();
+        VECTOR_PUSH(paths, path);
+    }
+}
+
+void renames_start(const State *state) {
+    ASSERT(state != NULL && current_job == NULL);
+
+    RenameJob *job = (RenameJob *) calloc(1, sizeof(RenameJob));
+    if (job == NULL) OUT_OF_MEMORY();
+
+    collect_paths(&state->unstaged, &job->paths[UNSTAGED]);
+    collect_paths(&state->staged, &job->paths[STAGED]);
+    if (job->paths[UNSTAGED].length == 0 && job->paths[STAGED].length == 0) {
+        free_job(job);
+        return;
+    }
+
+    if (notify_fds[0] == -1) {
+        if (pipe(notify_fds) == -1) ERROR("Unable to create pipe: %s.\n", strerror(errno));
+        int flags = fcntl(notify_fds[0], F_GETFL, 0);
+        if (flags == -1 || fcntl(notify_fds[0], F_SETFL, flags | O_NONBLOCK) == -1)
+            ERROR("Unable to make file description non-blocking: %s.\n", strerror(errno));
+    }
+
+    current_job = job;
+    is_finished = false;
+
+    // cancelled jobs aren't waited for, so the thread isn't joined
+    pthread_t thread;
+    int error = pthread_create(&thread, NULL, &detect_renames, job);
+    if (error != 0) ERROR("Unable to create rename detection thread: %s.\n", strerror(error));
+    pthread_detach(thread);
+}
+
+static void drain_pipe(void) {
+    char buffer[64];
+    ssize_t bytes;
+    while ((bytes = read(notify_fds[0], buffer, sizeof(buffer))) > 0) continue;
+    if (bytes == -1 && errno != EAGAIN) ERROR("Unable to read from pipe: %s.\n", strerror(errno));
+}
+
+void renames_cancel(void) {
+    if (current_job == NULL) return;
+
+    pthread_mutex_lock(&mutex);
+    if (is_finished) free_job(current_job);
+    else current_job->is_cancelled = true;
+    current_job = NULL;
+    is_finished = false;
+    pthread_mutex_unlock(&mutex);
+
+    drain_pipe();
+}
+
+int renames_fd(void) { return current_job == NULL ? -1 : notify_fds[0]; }
+
+static int compare_paths(const void *a, const void *b) { return strcmp(((const PathIndex *) a)->path, ((const PathIndex *) b)->path); }
+
+static File *find_file(Section *section, const PathIndexVec *index, const char *path, FileChange change_type) {
+    ASSERT(section != NULL && index != NULL && path != NULL);
+    if (index->length == 0) return NULL;
+
+    PathIndex key = {path, 0};
+    PathIndex *found = (PathIndex *) bsearch(&key, index->data, index->length, sizeof(PathIndex), &compare_paths);
+    if (found == NULL) return NULL;
+
+    File *file = &section->files.data[found->index];
+    return file->change_type == change_type ? file : NULL;
+}
+
+// Parses "<status>\0<path>\0" and "R<score>\0<src>\0<dst>\0" entries.
+static void pair_renames(Section *section, char *output) {
+    ASSERT(section != NULL && output != NULL);
+
+    // renamed files point into the output
+    mem_recategorize(output, MEM_DIFF_TEXT);
+    VECTOR_PUSH(&section->raw, ((TextBlock){output, 0}));
+
+    FileVec *files = &section->files;
+    PathIndexVec index = {0};
+    for (size_t i = 0; i < files->length; i++) {
+        const File *file = &files->data[i];
+        if (file->change_type == FC_CREATED || file->change_type == FC_DELETED) VECTOR_PUSH(&index, ((PathIndex){file->dst, i}));
+    }
+    if (index.length > 0) qsort(index.data, index.length, sizeof(PathIndex), &compare_paths);
+
+    // pointers into `files` stay valid, because deleted files are removed after pairing
+    bool *is_paired = (bool *) calloc(files->length + 1, sizeof(bool));
+    if (is_paired == NULL) OUT_OF_MEMORY();
+
+    char *entry = output;
+    while (*entry != '\0') {
+        char *src = entry + strlen(entry) + 1;
+        char *next = src + strlen(src) + 1;
+        if (entry[0] != 'R') {
+            entry = next;
+            continue;
+        }
+
+        char *dst = next;
+        entry = dst + strlen(dst) + 1;
+
+        File *deleted = find_file(section, &index, src, FC_DELETED);
+        File *created = find_file(section, &index, dst, FC_CREATED);
+        if (deleted == NULL || created == NULL) continue;
+
+        is_paired[deleted - files->data] = true;
+
+        // diff of the renamed file is requested when it is unfolded
+        bool is_folded = created->is_folded;
+        *created = (File){0};
+        created->is_folded = is_folded;
+        created->is_summary = true;
+        created->change_type = FC_RENAMED;
+        created->src = src;
+        created->dst = dst;
+    }
+
+    size_t length = 0;
+    for (size_t i = 0; i < files->length; i++) {
+        if (!is_paired[i]) files->data[length++] = files->data[i];
+    }
+    files->length = length;
+
+    free(is_paired);
+    VECTOR_FREE(&index);
+}
+
+bool renames_collect(State *state) {
+    ASSERT(state != NULL);
+    if (current_job == NULL) return false;
+
+    drain_pipe();
+
+    pthread_mutex_lock(&mutex);
+    bool finished = is_finished;
+    is_finished = false;
+    pthread_mutex_unlock(&mutex);
+    if (!finished) return false;
+
+    RenameJob *job = current_job;
+    current_job = NULL;
+
+    Section *sections[2] = {&state->unstaged, &state->staged};
+    for (size_t i = 0; i < 2; i++) {
+        if (job->outputs[i] == NULL) continue;
+
+        pair_renames(sections[i], job->outputs[i]);
+        job->outputs[i] = NULL;
+        sections[i]->is_renames_deferred = false;
+    }
+    free_job(job);
+
+    return true;
+}
@@ -0,0 +1,20 @@
+#ifndef RENAMES_H
+#define RENAMES_H
+
+#include <ncurses.h>
+#include "git/state.h"
+
+// Sections with many created and deleted files are loaded without rename detection, which is
+// quadratic. Renames are then detected in the background and merged into the state.
+
+// Starts detection for sections of `state` with deferred renames, if there are any.
+void renames_start(const State *state);
+// Discards running detection, its results would be outdated. Must be called before replacing the state.
+void renames_cancel(void);
+
+// Descriptor which becomes readable when detection is finished, -1 if nothing is running.
+int renames_fd(void);
+// Replaces created and deleted files of detected renames with renamed ones. Returns whether state has changed.
+bool renames_collect(State *state);
+
+#endif  // RENAMES_H
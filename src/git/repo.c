@@ -0,0 +1,243 @@
+#define _DEFAULT_SOURCE
+#include "repo.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "error.h"
+#include "git/catfile.h"
+
+#define MAX_PATH_LENGTH 4096
+
+// Maximum length of a chain of symbolic refs, e.g. HEAD -> refs/heads/main
+#define MAX_SYMREF_DEPTH 5
+
+static char *root = NULL;
+static char *git_dir = NULL;
+// Shared between worktrees: branches, packed-refs, objects
+static char *common_dir = NULL;
+static bool has_commits = false;
+
+static void trim_newline(char *str) {
+    ASSERT(str != NULL);
+
+    size_t length = strlen(str);
+    while (length > 0 && (str[length - 1] == '\n' || str[length - 1] == '\r')) str[--length] = '\0';
+}
+
+// Returns malloc()-ed contents of `dir`/`name`, or NULL if it can't be read.
+static char *read_file(const char *dir, const char *name) {
+    ASSERT(dir != NULL && name != NULL);
+
+    char path[MAX_PATH_LENGTH];
+    if (snprintf(path, sizeof(path), "%s/%s", dir, name) >= (int) sizeof(path)) return NULL;
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return NULL;
+
+    struct stat file_info;
+    if (fstat(fd, &file_info) == -1 || !S_ISREG(file_info.st_mode)) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t size = file_info.st_size;
+    char *buffer = (char *) malloc(size + 1);
+    if (buffer == NULL) OUT_OF_MEMORY();
+
+    ssize_t bytes = read(fd, buffer, size);
+    close(fd);
+    if (bytes == -1) {
+        free(buffer);
+        return NULL;
+    }
+
+    buffer[bytes] = '\0';
+    return buffer;
+}
+
+static bool is_dir(const char *dir, const char *name) {
+    ASSERT(dir != NULL && name != NULL);
+
+    char path[MAX_PATH_LENGTH];
+    if (snprintf(path, sizeof(path), "%s/%s", dir, name) >= (int) sizeof(path)) return false;
+
+    struct stat file_info;
+    return stat(path, &file_info) == 0 && S_ISDIR(file_info.st_mode);
+}
+
+// Returns malloc()-ed absolute path of `path`, which is relative to `dir` unless it is absolute.
+static char *resolve_path(const char *dir, const char *path) {
+    ASSERT(dir != NULL && path != NULL);
+    if (path[0] == '/') return realpath(path, NULL);
+
+    char joined[MAX_PATH_LENGTH];
+    if (snprintf(joined, sizeof(joined), "%s/%s", dir, path) >= (int) sizeof(joined)) return NULL;
+    return realpath(joined, NULL);
+}
+
+static bool is_git_dir(const char *path) {
+    ASSERT(path != NULL);
+
+    char *head = read_file(path, "HEAD");
+    if (head == NULL) return false;
+    free(head);
+    return true;
+}
+
+// Checks `dir`/.git, which is either a git directory or a gitfile ("gitdir: <path>").
+// Returns malloc()-ed absolute path of the git directory or NULL.
+static char *find_git_dir(const char *dir) {
+    ASSERT(dir != NULL);
+
+    if (is_dir(dir, ".git")) {
+        char *path = resolve_path(dir, ".git");
+        if (path != NULL && is_git_dir(path)) return path;
+        free(path);
+        return NULL;
+    }
+
+    char *gitfile = read_file(dir, ".git");
+    if (gitfile == NULL) return NULL;
+
+    char *path = NULL;
+    static const char *prefix = "gitdir: ";
+    if (strncmp(gitfile, prefix, strlen(prefix)) == 0) {
+        trim_newline(gitfile);
+        path = resolve_path(dir, gitfile + strlen(prefix));
+        if (path != NULL && !is_git_dir(path)) {
+            free(path);
+            path = NULL;
+        }
+    }
+
+    free(gitfile);
+    return path;
+}
+
+bool repo_discover(void) {
+    const char *git_dir_env = getenv("GIT_DIR");
+    if (git_dir_env != NULL) {
+        git_dir = realpath(git_dir_env, NULL);
+        const char *work_tree_env = getenv("GIT_WORK_TREE");
+        root = realpath(work_tree_env == NULL ? "." : work_tree_env, NULL);
+        if (git_dir == NULL || root == NULL || !is_git_dir(git_dir)) return false;
+    } else {
+        char dir[MAX_PATH_LENGTH];
+        if (getcwd(dir, sizeof(dir)) == NULL) ERROR("Unable to get current directory: %s.\n", strerror(errno));
+
+        while ((git_dir = find_git_dir(dir)) == NULL) {
+            if (strcmp(dir, "/") == 0) return false;
+
+            char *slash = strrchr(dir, '/');
+            ASSERT(slash != NULL);
+            if (slash == dir) slash++;
+            *slash = '\0';
+        }
+
+        root = strdup(dir);
+        if (root == NULL) OUT_OF_MEMORY();
+    }
+
+    // linked worktrees store path to the main git directory in "commondir"
+    char *commondir = read_file(git_dir, "commondir");
+    if (commondir != NULL) {
+        trim_newline(commondir);
+        common_dir = resolve_path(git_dir, commondir);
+        free(commondir);
+    }
+    if (common_dir == NULL) {
+        common_dir = strdup(git_dir);
+        if (common_dir == NULL) OUT_OF_MEMORY();
+    }
+
+    return true;
+}
+
+const char *repo_root(void) {
+    ASSERT(root != NULL);
+    return root;
+}
+
+const char *repo_git_dir(void) {
+    ASSERT(git_dir != NULL);
+    return git_dir;
+}
+
+static bool is_per_worktree_ref(const char *name) {
+    ASSERT(name != NULL);
+
+    return strcmp(name, "HEAD") == 0 || strncmp(name, "refs/worktree/", 14) == 0 || strncmp(name, "refs/bisect/", 12) == 0
+           || strncmp(name, "refs/rewritten/", 15) == 0;
+}
+
+static bool is_packed_ref(const char *name) {
+    ASSERT(name != NULL);
+
+    char *packed_refs = read_file(common_dir, "packed-refs");
+    if (packed_refs == NULL) return false;
+
+    // "<id> <name>" lines, along with "# comments" and "^<peeled id>" of annotated tags
+    bool found = false;
+    size_t name_length = strlen(name);
+    for (char *line = packed_refs; *line != '\0' && !found;) {
+        char *end = strchr(line, '\n');
+        if (end == NULL) end = line + strlen(line);
+
+        if (line[0] != '#' && line[0] != '^') {
+            char *space = (char *) memchr(line, ' ', end - line);
+            if (space != NULL && (size_t) (end - space - 1) == name_length && strncmp(space + 1, name, name_length) == 0) found = true;
+        }
+
+        line = *end == '\0' ? end : end + 1;
+    }
+
+    free(packed_refs);
+    return found;
+}
+
+static bool ref_exists(const char *name, int depth) {
+    ASSERT(name != NULL);
+    if (depth > MAX_SYMREF_DEPTH) return false;
+
+    char *contents = read_file(is_per_worktree_ref(name) ? git_dir : common_dir, name);
+    if (contents == NULL) return is_packed_ref(name);
+
+    trim_newline(contents);
+
+    bool exists;
+    static const char *symref_prefix = "ref: ";
+    if (strncmp(contents, symref_prefix, strlen(symref_prefix)) == 0) exists = ref_exists(contents + strlen(symref_prefix), depth + 1);
+    else exists = contents[0] != '\0';  // object id
+
+    free(contents);
+    return exists;
+}
+
+bool repo_has_commits(void) {
+    ASSERT(git_dir != NULL && common_dir != NULL);
+
+    // commits can't disappear, so only the negative result is rechecked
+    if (has_commits) return true;
+
+    if (is_dir(common_dir, "reftable")) {
+        // refs aren't stored in files, ask git instead
+        const char *head = "HEAD";
+        ObjectInfo head_info;
+        catfile_info(&head, 1, &head_info);
+        has_commits = head_info.exists;
+    } else {
+        has_commits = ref_exists("HEAD", 0);
+    }
+
+    return has_commits;
+}
+
+void repo_cleanup(void) {
+    free(root);
+    free(git_dir);
+    free(common_dir);
+}
@@ -0,0 +1,21 @@
+#ifndef REPO_H
+#define REPO_H
+
+#include <ncurses.h>
+
+// Repository discovery without spawning git: walks up from the current directory
+// to find ".git" (either a directory or a gitfile pointing to one, as in worktrees
+// and submodules). Returns whether repository was found.
+bool repo_discover(void);
+
+// Absolute paths of worktree's top-level directory and of its git directory.
+const char *repo_root(void);
+const char *repo_git_dir(void);
+
+// Resolves HEAD through loose and packed refs. Once it is known that
+// repository has commits, the result is cached.
+bool repo_has_commits(void);
+
+void repo_cleanup(void);
+
+#endif  // REPO_H
@@ -0,0 +1,222 @@
+#define _DEFAULT_SOURCE
+#include "staging.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "error.h"
+#include "git/exec.h"
+#include "git/patch.h"
+#include "git/repo.h"
+#include "vector.h"
+
+// "-" means to read from stdin instead of file
+// clang-format off
+static char *const CMD_APPLY[]         = {"git", "apply", "--cached", "-", NULL};
+static char *const CMD_APPLY_REVERSE[] = {"git", "apply", "--cached", "--reverse", "-", NULL};
+// clang-format on
+
+typedef struct {
+    StagingKind kind;
+    char *path;
+    char *patch;
+    const char *subject;
+    char *error;  // malloc()-ed message, NULL if operation has succeeded
+} StagingOp;
+
+VECTOR_TYPEDEF(StagingOpVec, StagingOp);
+
+static pthread_t thread;
+static bool is_running = false;
+static int notify_fds[2] = {-1, -1};
+// Only used by the main thread
+static size_t pending = 0;
+static str_vec errors = {0};
+static size_t failures = 0;
+
+// Everything below is shared with the staging thread and protected by the mutex
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t is_queued = PTHREAD_COND_INITIALIZER;
+static bool is_stopping = false;
+static bool is_notified = false;
+static StagingOpVec queue = {0};
+static size_t queue_start = 0;
+static StagingOpVec finished = {0};
+
+// `fmt` receives subject, path and path of the failed patch, in this order.
+static char *format_error(const char *fmt, const char *subject, const char *path) {
+    ASSERT(fmt != NULL && subject != NULL && path != NULL);
+
+    size_t size = snprintf(NULL, 0, fmt, subject, path, FAILED_PATCH_PATH) + 1;
+    char *error = (char *) malloc(size);
+    if (error == NULL) OUT_OF_MEMORY();
+    snprintf(error, size, fmt, subject, path, FAILED_PATCH_PATH);
+    return error;
+}
+
+static bool unstage_file(char *path) {
+    ASSERT(path != NULL);
+    if (gexec(CMD("git", "restore", "--staged", path)) == 0) return true;
+
+    // There is one valid case when it might fail: there are no commits yet
+    // thus `restore --staged` it fails to restore the file to the last commit
+    // as there isn't any.
+    if (repo_has_commits()) return false;
+
+    // If this is the case we know that the file wasn't staged before, so we can
+    // safely remove it from the index using `git rm --cached`.
+    // NOTE: `--force` is required for files that are partially staged
+    return gexec(CMD("git", "rm", "--cached", "--force", path)) == 0;
+}
+
+static void run(StagingOp *op) {
+    ASSERT(op != NULL);
+
+    switch (op->kind) {
+        case SO_STAGE_FILE:
+            if (gexec(CMD("git", "add", op->path)) != 0) op->error = format_error("Unable to stage %s \"%s\".", op->subject, op->path);
+            break;
+        case SO_UNSTAGE_FILE:
+            if (!unstage_file(op->path)) op->error = format_error("Unable to unstage %s \"%s\".", op->subject, op->path);
+            break;
+        case SO_APPLY_PATCH:
+        case SO_APPLY_REVERSE_PATCH: {
+            bool is_reverse = op->kind == SO_APPLY_REVERSE_PATCH;
+            if (gexecw(is_reverse ? CMD_APPLY_REVERSE : CMD_APPLY, op->patch) == 0) break;
+
+            DUMP_PATCH(op->patch);
+            op->error = format_error(is_reverse ? "Unable to unstage %s of \"%s\". Failed patch written to \"%s\"."
+                                                : "Unable to stage %s of \"%s\". Failed patch written to \"%s\".",
+                                     op->subject, op->path);
+        } break;
+        default: UNREACHABLE();
+    }
+}
+
+static void *serve(void *arg) {
+    (void) arg;
+
+    pthread_mutex_lock(&mutex);
+    while (true) {
+        while (queue_start == queue.length && !is_stopping) pthread_cond_wait(&is_queued, &mutex);
+        // queued operations are finished before stopping
+        if (queue_start == queue.length) break;
+
+        StagingOp op = queue.data[queue_start++];
+        if (queue_start == queue.length) {
+            queue_start = 0;
+            VECTOR_RESET(&queue);
+        }
+        pthread_mutex_unlock(&mutex);
+
+        run(&op);
+
+        pthread_mutex_lock(&mutex);
+        VECTOR_PUSH(&finished, op);
+        if (!is_notified) {
+            char byte = 0;
+            if (write(notify_fds[1], &byte, 1) != 1) ERROR("Unable to write to pipe: %s.\n", strerror(errno));
+            is_notified = true;
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+
+    return NULL;
+}
+
+static void start(void) {
+    ASSERT(!is_running);
+
+    if (pipe(notify_fds) == -1) ERROR("Unable to create pipe: %s.\n", strerror(errno));
+    int flags = fcntl(notify_fds[0], F_GETFL, 0);
+    if (flags == -1 || fcntl(notify_fds[0], F_SETFL, flags | O_NONBLOCK) == -1)
+        ERROR("Unable to make file description non-blocking: %s.\n", strerror(errno));
+
+    is_running = true;
+    int error = pthread_create(&thread, NULL, &serve, NULL);
+    if (error != 0) ERROR("Unable to create staging thread: %s.\n", strerror(error));
+}
+
+static void clear_errors(void) {
+    for (size_t i = 0; i < errors.length; i++) free(errors.data[i]);
+    VECTOR_RESET(&errors);
+}
+
+void staging_push(StagingKind kind, const char *path, char *patch, const char *subject) {
+    ASSERT(path != NULL && subject != NULL);
+    ASSERT((patch != NULL) == (kind == SO_APPLY_PATCH || kind == SO_APPLY_REVERSE_PATCH));
+
+    if (!is_running) start();
+    clear_errors();
+
+    StagingOp op = {kind, strdup(path), patch, subject, NULL};
+    if (op.path == NULL) OUT_OF_MEMORY();
+
+    pthread_mutex_lock(&mutex);
+    VECTOR_PUSH(&queue, op);
+    pthread_cond_signal(&is_queued);
+    pthread_mutex_unlock(&mutex);
+
+    pending++;
+}
+
+size_t staging_pending(void) { return pending; }
+
+const str_vec *staging_errors(void) { return &errors; }
+
+size_t staging_failures(void) { return failures; }
+
+int staging_fd(void) { return pending > 0 ? notify_fds[0] : -1; }
+
+bool staging_collect(void) {
+    if (pending == 0) return false;
+
+    char buffer[64];
+    ssize_t bytes;
+    while ((bytes = read(notify_fds[0], buffer, sizeof(buffer))) > 0) continue;
+    if (bytes == -1 && errno != EAGAIN) ERROR("Unable to read from pipe: %s.\n", strerror(errno));
+
+    pthread_mutex_lock(&mutex);
+    is_notified = false;
+    StagingOpVec ops = finished;
+    finished = (StagingOpVec){0};
+    pthread_mutex_unlock(&mutex);
+
+    for (size_t i = 0; i < ops.length; i++) {
+        StagingOp *op = &ops.data[i];
+        if (op->error != NULL) {
+            VECTOR_PUSH(&errors, op->error);
+            failures++;
+        }
+        free(op->path);
+        free(op->patch);
+    }
+    ASSERT(ops.length <= pending);
+    pending -= ops.length;
+
+    bool has_finished = ops.length > 0;
+    VECTOR_FREE(&ops);
+    return has_finished;
+}
+
+void staging_cleanup(void) {
+    if (!is_running) return;
+
+    pthread_mutex_lock(&mutex);
+    is_stopping = true;
+    pthread_cond_signal(&is_queued);
+    pthread_mutex_unlock(&mutex);
+
+    int error = pthread_join(thread, NULL);
+    if (error != 0) ERROR("Unable to join staging thread: %s.\n", strerror(error));
+    is_running = false;
+
+    staging_collect();
+    clear_errors();
+    VECTOR_FREE(&errors);
+    VECTOR_FREE(&queue);
+    close(notify_fds[0]);
+    close(notify_fds[1]);
+}
@@ -0,0 +1,33 @@
+#ifndef STAGING_H
+#define STAGING_H
+
+#include <ncurses.h>
+#include <stdlib.h>
+#include "vector.h"
+
+// Staging commands are run one by one on a background thread, in the order they were queued,
+// so that a patch is applied after the ones it depends on. The UI keeps taking keys meanwhile.
+// A failed operation is reported instead of exiting, the ones after it are still run.
+
+typedef enum { SO_STAGE_FILE, SO_UNSTAGE_FILE, SO_APPLY_PATCH, SO_APPLY_REVERSE_PATCH } StagingKind;
+
+// Queues an operation on `path`, `patch` is taken over and must be malloc()-ed (NULL for file operations).
+// `subject` is a static description of what is staged, it is used in error messages.
+void staging_push(StagingKind kind, const char *path, char *patch, const char *subject);
+
+// Number of operations which are queued or running.
+size_t staging_pending(void);
+// Messages of the operations that have failed since the last push.
+const str_vec *staging_errors(void);
+// Number of operations that have failed since sagit has started.
+size_t staging_failures(void);
+
+// Descriptor which becomes readable when operations are finished, -1 if nothing is queued.
+int staging_fd(void);
+// Collects finished operations. Returns whether any of them has finished.
+bool staging_collect(void);
+
+// Waits for the queued operations to finish and stops the thread.
+void staging_cleanup(void);
+
+#endif  // STAGING_H
@@ -1,29 +1,36 @@
 #include "state.h"
+#include <errno.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include "ctxt.h"
 #include "error.h"
+#include "memstat.h"
 #include "vector.h"
 
-void free_files(FileVec *files) {
-    ASSERT(files != NULL);
+void free_text_block(TextBlock *block) {
+    ASSERT(block != NULL);
 
-    for (size_t i = 0; i < files->length; i++) {
-        for (size_t j = 0; j < files->data[i].hunks.length; j++) {
-            VECTOR_FREE(&files->data[i].hunks.data[j].lines);
-        }
-        VECTOR_FREE(&files->data[i].hunks);
+    if (block->mapped_size == 0) {
+        mem_free(block->data);
+    } else {
+        if (munmap(block->data, block->mapped_size) == -1) ERROR("Unable to unmap diff text: %s.\n", strerror(errno));
+        mem_unaccount(MEM_SPOOLED_TEXT, block->mapped_size);
     }
-    VECTOR_FREE(files);
+    block->data = NULL;
 }
 
-void free_state(State *state) {
-    ASSERT(state != NULL);
+static void free_section(Section *section) {
+    ASSERT(section != NULL);
 
-    ctxt_free(&state->untracked_ctxt);
+    for (size_t i = 0; i < section->raw.length; i++) free_text_block(&section->raw.data[i]);
+    VECTOR_FREE(&section->raw);
+}
 
-    free(state->unstaged.raw);
-    free_files(&state->unstaged.files);
+void free_state(State *state) {
+    ASSERT(state != NULL);
 
-    free(state->staged.raw);
-    free_files(&state->staged.files);
+    ctxt_free(&state->ctxt);
+    free_section(&state->unstaged);
+    free_section(&state->staged);
 }
@@ -2,13 +2,22 @@
 #define STATE_H
 
 #include <ncurses.h>
+#include <stdint.h>
 #include "ctxt.h"
 #include "vector.h"
 
+typedef enum { LK_CONTEXT, LK_ADD, LK_DEL, LK_NO_NEWLINE, LK_HUNK } LineKind;
+
 typedef struct {
     bool is_folded;
-    const char *header;
-    str_vec lines;
+    // ranges from the header "@@ -<old_start>,<old_length> +<new_start>,<new_length> @@"
+    int old_start;
+    int old_length;
+    int new_start;
+    int new_length;
+    // lines are stored in file's line table, header is the line before the first one
+    size_t first_line;
+    size_t lines_count;
 } Hunk;
 
 VECTOR_TYPEDEF(HunkVec, Hunk);
@@ -23,24 +32,60 @@ typedef struct {
     const char *dst;
     const char *old_mode;
     const char *new_mode;
+    // Files of a big change set are loaded from the summary, which has no diff (see `load_file_diff`)
+    bool is_summary;
+    bool has_stat;
+    int added_lines;
+    int deleted_lines;
+    // Text of the hunks, they are only parsed when needed (see `load_hunks`)
+    char *raw;
+    size_t raw_length;
+    // Hash of the file's whole section of the diff, parsed hunks are reused while it doesn't change
+    uint64_t fingerprint;
     HunkVec hunks;
+    // Line table: lines are stored in `raw` at `line_offsets`, which have one more element at
+    // the end so that the length of every line is known. Lines aren't null-terminated and
+    // offsets are relative, so the table stays valid for a copy of the same text.
+    uint32_t *line_offsets;
+    uint8_t *line_kinds;  // LineKind
+    size_t lines_count;
 } File;
 
 VECTOR_TYPEDEF(FileVec, File);
 
+// `i`-th line of the `hunk` which belongs to the `file`
+#define HUNK_LINE(file, hunk, i) ((file)->raw + (file)->line_offsets[(hunk)->first_line + (i)])
+#define HUNK_LINE_LENGTH(file, hunk, i) \
+    ((size_t) ((file)->line_offsets[(hunk)->first_line + (i) + 1] - (file)->line_offsets[(hunk)->first_line + (i)] - 1))
+#define HUNK_HEADER(file, hunk) ((file)->raw + (file)->line_offsets[(hunk)->first_line - 1])
+#define HUNK_HEADER_LENGTH(file, hunk) \
+    ((size_t) ((file)->line_offsets[(hunk)->first_line] - (file)->line_offsets[(hunk)->first_line - 1] - 1))
+#define HUNK_LINE_KIND(file, hunk, i) ((LineKind) (file)->line_kinds[(hunk)->first_line + (i)])
+
+// Diff text which files point into. Big diffs are spooled to files (see `DiffParser`).
+typedef struct {
+    char *data;
+    size_t mapped_size;  // size of the file mapping, 0 if data is allocated with `mem_alloc`
+} TextBlock;
+
+VECTOR_TYPEDEF(TextBlockVec, TextBlock);
+
 typedef struct {
     bool is_folded;
-    char *raw;
-    FileVec files;
+    bool is_renames_deferred;  // created and deleted files haven't been paired into renamed ones yet
+    TextBlockVec raw;
+    FileVec files;  // allocated from state's context
 } Section;
 
+// Snapshot of the changes. Everything but the diff text, which is read in growing blocks, is
+// allocated from the context: files, their hunks and line tables, and text of untracked files.
 typedef struct {
-    MemoryContext untracked_ctxt;
+    MemoryContext ctxt;
     Section unstaged;
     Section staged;
 } State;
 
-void free_files(FileVec *files);
+void free_text_block(TextBlock *block);
 void free_state(State *state);
 
 #endif  // STATE_H
@@ -0,0 +1,78 @@
+#include "status.h"
+#include <stdlib.h>
+#include <string.h>
+#include "error.h"
+#include "git/exec.h"
+#include "memstat.h"
+#include "vector.h"
+
+// clang-format off
+// Renames are detected by diffs, which only need both paths (see `load_git_state`)
+static char *const CMD_STATUS[] = {"git", "status", "--porcelain=v2", "-z", "--untracked-files=all", "--no-renames", NULL};
+// clang-format on
+
+// Number of space-separated fields preceding the path in each entry type
+#define ORDINARY_FIELDS 8
+#define RENAMED_FIELDS 9
+#define UNMERGED_FIELDS 10
+
+static char *skip_fields(char *entry, int fields) {
+    ASSERT(entry != NULL);
+
+    for (int i = 0; i < fields; i++) {
+        entry = strchr(entry, ' ');
+        if (entry == NULL) ERROR("Unable to parse git status entry.\n");
+        entry++;
+    }
+
+    return entry;
+}
+
+void get_status(Status *status) {
+    ASSERT(status != NULL);
+
+    *status = (Status){0};
+    status->raw = gexecr(CMD_STATUS);
+
+    // entries are separated by '\0', which gexecr's result may contain
+    char *entry = status->raw;
+    while (*entry != '\0') {
+        char *next = entry + strlen(entry) + 1;
+
+        switch (entry[0]) {
+            case '1':
+            case '2':
+            case 'u': {
+                StatusEntry status_entry = {entry[2], entry[3], NULL, NULL};
+                if (entry[0] == '1') {
+                    status_entry.path = skip_fields(entry, ORDINARY_FIELDS);
+                } else if (entry[0] == '2') {
+                    status_entry.path = skip_fields(entry, RENAMED_FIELDS);
+                    status_entry.orig_path = next;
+                    next += strlen(next) + 1;
+                } else {
+                    status_entry.path = skip_fields(entry, UNMERGED_FIELDS);
+                }
+                VECTOR_PUSH(&status->entries, status_entry);
+            } break;
+            case '?':
+                VECTOR_PUSH(&status->untracked, entry + 2);
+                break;
+            case '!':
+            case '#':
+                break;
+            default:
+                ERROR("Unknown git status entry: \"%s\".\n", entry);
+        }
+
+        entry = next;
+    }
+}
+
+void free_status(Status *status) {
+    ASSERT(status != NULL);
+
+    VECTOR_FREE(&status->entries);
+    VECTOR_FREE(&status->untracked);
+    mem_free(status->raw);
+}
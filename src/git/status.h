@@ -0,0 +1,28 @@
+#ifndef STATUS_H
+#define STATUS_H
+
+#include "vector.h"
+
+#define STATUS_UNCHANGED '.'
+
+typedef struct {
+    // XY codes of porcelain v2 format, e.g. 'M', 'A', 'D', 'R' or STATUS_UNCHANGED
+    char staged;
+    char unstaged;
+    const char *path;
+    const char *orig_path;  // source of rename/copy, NULL otherwise
+} StatusEntry;
+
+VECTOR_TYPEDEF(StatusVec, StatusEntry);
+
+typedef struct {
+    char *raw;
+    StatusVec entries;  // tracked changes
+    str_vec untracked;
+} Status;
+
+// Lists changed and untracked paths with a single `git status` call.
+void get_status(Status *status);
+void free_status(Status *status);
+
+#endif  // STATUS_H
@@ -1,10 +1,20 @@
+#include <errno.h>
 #include <ncurses.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 #include "config.h"
 #include "error.h"
 #include "event.h"
+#include "git/catfile.h"
 #include "git/git.h"
+#include "git/journal.h"
+#include "git/loader.h"
+#include "git/refresh.h"
+#include "git/repo.h"
+#include "git/staging.h"
 #include "git/state.h"
+#include "memstat.h"
 #include "signals.h"
 #include "ui/action.h"
 #include "ui/help.h"
@@ -27,7 +37,13 @@ static State state = {0};
 static void cleanup(void) {
     poll_cleanup();
     ui_cleanup();
+    journal_flush();
+    staging_cleanup();
+    catfile_cleanup();
+    repo_cleanup();
     free_state(&state);
+    // after everything is freed, so that live memory shows leaks
+    mem_report();
 }
 
 static void handle_info(void) {
@@ -91,6 +107,10 @@ static void scroll_up_to(int y, int *scroll, int *cursor) {
 
 static void handle_main(void) {
     static int scroll = 0, cursor = 0, selection = -1;
+    static size_t render_count = 0;
+
+    // state has been replaced in the background, selected lines are gone with it
+    if (get_render_count() != render_count) selection = -1;
 
     // make sure there is always content on the screen
     if (scroll > get_lines_length()) scroll = MAX(0, get_lines_length() - cursor);
@@ -127,7 +147,10 @@ static void handle_main(void) {
                 show_help = true;
                 break;
             case 'r':
-                update_git_state(&state);
+                refresh_start(&state);
+                break;
+            case 'w':
+                journal_flush();
                 render(&state);
                 break;
             case MOUSE_SCROLL_DOWN:
@@ -170,9 +193,8 @@ static void handle_main(void) {
             default:
                 if (y < get_lines_length()) {
                     int result = invoke_action(y, ch, selection_start, selection_end);
+                    // state is updated once the queued operation is finished, pending one is shown meanwhile
                     if (result & AC_UPDATE_STATE) {
-                        poll_ignore_event();
-                        update_git_state(&state);
                         if (cursor != selection_start && selection_start != -1) scroll_up_to(selection_start, &scroll, &cursor);
                         render(&state);
                     }
@@ -181,6 +203,7 @@ static void handle_main(void) {
                 }
         }
     }
+    render_count = get_render_count();
 }
 
 int main(int argc, char **argv) {
@@ -189,8 +212,9 @@ int main(int argc, char **argv) {
         return EXIT_FAILURE;
     }
 
-    if (!is_git_initialized()) ERROR("Git is not initialized in the current directory.\n");
-    get_git_state(&state);
+    if (!repo_discover()) ERROR("Git is not initialized in the current directory.\n");
+    if (chdir(repo_root()) == -1) ERROR("Unable to cd into \"%s\": %s.\n", repo_root(), strerror(errno));
+    loader_start();
 
     poll_init();
     ui_init();
@@ -208,7 +232,9 @@ int main(int argc, char **argv) {
         }
 
         if (is_state_empty(&state)) {
-            printw("There are no uncommitted changes.\n");
+            printw(is_loading() ? "Loading changes...\n" : "There are no uncommitted changes.\n");
+            const str_vec *errors = staging_errors();
+            for (size_t i = 0; i < errors->length; i++) printw("%s\n", errors->data[i]);
             handle_info();
             continue;
         }
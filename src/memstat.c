@@ -0,0 +1,92 @@
+#include "memstat.h"
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "error.h"
+
+#define REPORT_ENV "SAGIT_MEMSTAT"
+
+typedef struct {
+    alignas(max_align_t) size_t size;
+    MemoryCategory category;
+} AllocHeader;
+
+static atomic_size_t live[__MEM_SIZE];
+static atomic_size_t peak[__MEM_SIZE];
+
+// clang-format off
+static const char *category_names[__MEM_SIZE] = {
+    [MEM_STATE]          = "state",
+    [MEM_DIFF_TEXT]      = "diff text",
+    [MEM_SPOOLED_TEXT]   = "spooled text",
+    [MEM_UNTRACKED_TEXT] = "untracked text",
+    [MEM_GIT_OUTPUT]     = "git output",
+    [MEM_UI]             = "ui",
+    [MEM_VECTORS]        = "vectors",
+};
+// clang-format on
+
+void mem_account(MemoryCategory category, size_t size) {
+    ASSERT(category < __MEM_SIZE);
+
+    size_t new_live = atomic_fetch_add(&live[category], size) + size;
+    size_t old_peak = atomic_load(&peak[category]);
+    while (new_live > old_peak && !atomic_compare_exchange_weak(&peak[category], &old_peak, new_live)) continue;
+}
+
+void mem_unaccount(MemoryCategory category, size_t size) {
+    ASSERT(category < __MEM_SIZE);
+    atomic_fetch_sub(&live[category], size);
+}
+
+void *mem_alloc(MemoryCategory category, size_t size) { return mem_realloc(category, NULL, size); }
+
+void *mem_realloc(MemoryCategory category, void *ptr, size_t size) {
+    AllocHeader *header = NULL;
+    if (ptr != NULL) {
+        header = (AllocHeader *) ptr - 1;
+        category = header->category;
+        mem_unaccount(category, header->size);
+    }
+
+    header = (AllocHeader *) realloc(header, sizeof(AllocHeader) + size);
+    if (header == NULL) OUT_OF_MEMORY();
+
+    header->size = size;
+    header->category = category;
+    mem_account(category, size);
+    return header + 1;
+}
+
+void mem_free(void *ptr) {
+    if (ptr == NULL) return;
+
+    AllocHeader *header = (AllocHeader *) ptr - 1;
+    mem_unaccount(header->category, header->size);
+    free(header);
+}
+
+void mem_recategorize(void *ptr, MemoryCategory category) {
+    ASSERT(ptr != NULL);
+
+    AllocHeader *header = (AllocHeader *) ptr - 1;
+    mem_unaccount(header->category, header->size);
+    header->category = category;
+    mem_account(category, header->size);
+}
+
+MemoryUsage mem_usage(MemoryCategory category) {
+    ASSERT(category < __MEM_SIZE);
+    return (MemoryUsage){atomic_load(&live[category]), atomic_load(&peak[category])};
+}
+
+void mem_report(void) {
+    if (getenv(REPORT_ENV) == NULL) return;
+
+    fprintf(stderr, "%-14s %14s %14s\n", "memory", "live", "peak");
+    for (int i = 0; i < __MEM_SIZE; i++) {
+        MemoryUsage usage = mem_usage(i);
+        fprintf(stderr, "%-14s %14zu %14zu\n", category_names[i], usage.live, usage.peak);
+    }
+}
@@ -0,0 +1,44 @@
+#ifndef MEMSTAT_H
+#define MEMSTAT_H
+
+#include <stddef.h>
+
+// Live and peak bytes of memory, grouped by what it is used for. Counters are atomic, so
+// memory can be accounted from any thread. Memory contexts are accounted by their regions,
+// vectors by their capacity, and buffers that outlive their owner, e.g. git's output which
+// is kept as diff text, carry their size and category in a header (see `mem_alloc`).
+// When SAGIT_MEMSTAT environment variable is set, usage is printed to stderr at exit.
+
+// clang-format off
+typedef enum {
+    MEM_STATE,           // state's context: files, hunks and line tables
+    MEM_DIFF_TEXT,       // blocks of diff text which files point into
+    MEM_SPOOLED_TEXT,    // same, but mapped from files, so the kernel is able to page it out
+    MEM_UNTRACKED_TEXT,  // diff text synthesized from contents of untracked files
+    MEM_GIT_OUTPUT,      // output of git that is being read
+    MEM_UI,              // rendered lines and their tables
+    MEM_VECTORS,         // everything stored in vectors
+    __MEM_SIZE
+} MemoryCategory;
+// clang-format on
+
+typedef struct {
+    size_t live;
+    size_t peak;
+} MemoryUsage;
+
+void mem_account(MemoryCategory category, size_t size);
+void mem_unaccount(MemoryCategory category, size_t size);
+
+// Accounted malloc/realloc/free, memory has to be freed with `mem_free`.
+void *mem_alloc(MemoryCategory category, size_t size);
+// `ptr` may be NULL, `category` is only used then.
+void *mem_realloc(MemoryCategory category, void *ptr, size_t size);
+void mem_free(void *ptr);
+// Moves memory from `mem_alloc` to another category when it changes its purpose.
+void mem_recategorize(void *ptr, MemoryCategory category);
+
+MemoryUsage mem_usage(MemoryCategory category);
+void mem_report(void);
+
+#endif  // MEMSTAT_H
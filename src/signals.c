@@ -37,4 +37,8 @@ void setup_signal_handlers(void) {
 
     action.sa_handler = resize;
     sigaction(SIGWINCH, &action, NULL);
+
+    // Writing to a pipe of a dead child must return EPIPE instead of killing sagit
+    action.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &action, NULL);
 }
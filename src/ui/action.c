@@ -21,6 +21,7 @@ int untracked_file_action(void *_file_path, const ActionArgs *args) {
     ASSERT(file_path != NULL && args != NULL);
 
     if (args->ch == 's') {
+        if (is_path_pending(file_path)) return 0;
         git_stage_file(file_path);
         return AC_UPDATE_STATE;
     }
@@ -36,6 +37,7 @@ int unstaged_file_action(void *_file, const ActionArgs *args) {
         file->is_folded = !file->is_folded;
         return AC_RERENDER;
     } else if (args->ch == 's') {
+        if (is_file_pending(file)) return 0;
         switch (file->change_type) {
             case FC_MODIFIED:
             case FC_DELETED:
@@ -65,6 +67,7 @@ int staged_file_action(void *_file, const ActionArgs *args) {
         file->is_folded = !file->is_folded;
         return AC_RERENDER;
     } else if (args->ch == 'u') {
+        if (is_file_pending(file)) return 0;
         switch (file->change_type) {
             case FC_MODIFIED:
             case FC_DELETED:
@@ -95,6 +98,7 @@ int unstaged_hunk_action(void *_hunk_args, const ActionArgs *args) {
         hunk->is_folded = !hunk->is_folded;
         return AC_RERENDER;
     } else if (args->ch == 's') {
+        if (is_file_pending(hunk_args->file)) return 0;
         git_stage_hunk(hunk_args->file, hunk);
         return AC_UPDATE_STATE;
     }
@@ -111,6 +115,7 @@ int staged_hunk_action(void *_hunk_args, const ActionArgs *args) {
         hunk->is_folded = !hunk->is_folded;
         return AC_RERENDER;
     } else if (args->ch == 'u') {
+        if (is_file_pending(hunk_args->file)) return 0;
         git_unstage_hunk(hunk_args->file, hunk);
         return AC_UPDATE_STATE;
     }
@@ -125,8 +130,9 @@ int unstaged_line_action(void *_line_args, const ActionArgs *args) {
     if (args->ch == ' ') {
         return AC_TOGGLE_SELECTION;
     } else if (args->ch == 's') {
+        if (is_file_pending(line_args->file)) return 0;
         if (args->range_start == -1) {
-            if (line_args->hunk->lines.data[line_args->line][0] == ' ') return 0;
+            if (HUNK_LINE_KIND(line_args->file, line_args->hunk, line_args->line) == LK_CONTEXT) return 0;
             git_stage_range(line_args->file, line_args->hunk, line_args->line, line_args->line);
             return AC_UPDATE_STATE;
         } else {
@@ -145,8 +151,9 @@ int staged_line_action(void *_line_args, const ActionArgs *args) {
     if (args->ch == ' ') {
         return AC_TOGGLE_SELECTION;
     } else if (args->ch == 'u') {
+        if (is_file_pending(line_args->file)) return 0;
         if (args->range_start == -1) {
-            if (line_args->hunk->lines.data[line_args->line][0] == ' ') return 0;
+            if (HUNK_LINE_KIND(line_args->file, line_args->hunk, line_args->line) == LK_CONTEXT) return 0;
             git_unstage_range(line_args->file, line_args->hunk, line_args->line, line_args->line);
             return AC_UPDATE_STATE;
         } else {
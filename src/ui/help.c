@@ -15,10 +15,16 @@ static const char *help_lines[] = {
     "          on line: start selecting a range"                               ,
     "s       - stage untracked/unstaged change"                                ,
     "u       - unstaged staged change"                                         ,
+    "w       - apply recorded line and hunk (un)staging now"                   ,
     ""                                                                         ,
     "(Un)Staging scopes:"                                                      ,
     "Files and hunks by selecting their headers,"                              ,
     "Lines and ranges within hunks."                                           ,
+    "Consecutive line and hunk (un)staging of the same file is recorded and"   ,
+    "applied as one patch after a short pause. Recorded lines are highlighted" ,
+    "in place, they move to the other section only once the patch is applied." ,
+    "File headers show the number of recorded lines. If the file changes"      ,
+    "meanwhile, its unchanged hunks stay highlighted, and it still applies."   ,
     ""                                                                         ,
     "Selecting a range:"                                                       ,
     "Ranges must be selected within a single hunk!"                            ,
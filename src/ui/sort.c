@@ -15,6 +15,8 @@ static int compare_files(const File *files, size_t i, size_t j) { return strcmp(
 static void quicksort(const File *files, size_t *arr, size_t l, size_t r) {
     if (l >= r) return;
 
+    // middle element is used as pivot, because files are usually already sorted
+    swap(arr, l + (r - l) / 2, r);
     size_t pivot = arr[r];
     size_t i = l, j = r;
     while (i < j) {
@@ -7,7 +7,11 @@
 #include "config.h"
 #include "ctxt.h"
 #include "error.h"
+#include "git/diff.h"
+#include "git/fetch.h"
 #include "git/git.h"
+#include "git/journal.h"
+#include "git/staging.h"
 #include "git/state.h"
 #include "ui/action.h"
 #include "ui/sort.h"
@@ -15,6 +19,7 @@
 
 typedef struct {
     char *str;
+    int length;
     action_t *action;
     void *action_arg;
     int style;
@@ -27,17 +32,30 @@ static MemoryContext ctxt = {0};
 static LineVec lines = {0};
 static int line_styles[__LS_SIZE] = {0};
 static int_vec hunk_indexes = {0};
-
-#define ADD_LINE(action, arg, style, is_selectable, ...)                   \
-    do {                                                                   \
-        size_t size = snprintf(NULL, 0, __VA_ARGS__) + 1;                  \
-        char *str = (char *) ctxt_alloc(&ctxt, size);                      \
-        snprintf(str, size, __VA_ARGS__);                                  \
-        Line line = {str, action, arg, line_styles[style], is_selectable}; \
-        VECTOR_PUSH(&lines, line);                                         \
+static size_t render_count = 0;
+
+#define ADD_LINE(action, arg, style, is_selectable, ...)                             \
+    do {                                                                             \
+        size_t size = snprintf(NULL, 0, __VA_ARGS__) + 1;                            \
+        char *str = (char *) ctxt_alloc(&ctxt, size);                                \
+        snprintf(str, size, __VA_ARGS__);                                            \
+        Line line = {str, size - 1, action, arg, line_styles[style], is_selectable}; \
+        CATEGORY_VECTOR_PUSH(MEM_UI, &lines, line);                                  \
     } while (0)
 
-static const Line EMPTY_LINE = {" ", NULL, NULL, 0, 0};
+static const Line EMPTY_LINE = {" ", 1, NULL, NULL, 0, 0};
+
+// Same as ADD_LINE with "%s", but length of the `text` is already known
+static void add_text_line(action_t *action, void *arg, int style, bool is_selectable, const char *text, size_t length) {
+    ASSERT(text != NULL);
+
+    char *str = (char *) ctxt_alloc(&ctxt, length + 1);
+    memcpy(str, text, length);
+    str[length] = '\0';
+
+    Line line = {str, length, action, arg, line_styles[style], is_selectable};
+    CATEGORY_VECTOR_PUSH(MEM_UI, &lines, line);
+}
 
 static void init_styles(void) {
     ASSERT(sizeof(line_styles) / sizeof(line_styles[0]) == __LS_SIZE);
@@ -50,37 +68,65 @@ static void init_styles(void) {
     }
 }
 
-static void render_files(const FileVec *files, action_t *file_action, action_t *hunk_action, action_t *line_action) {
-    ASSERT(files != NULL);
+// Formats " (+<added> -<deleted>)" of files loaded from summary, empty string otherwise.
+static void format_stat(const File *file, char *buffer, size_t size) {
+    ASSERT(file != NULL && buffer != NULL);
+
+    if (!file->has_stat) buffer[0] = '\0';
+    else if (file->is_binary) snprintf(buffer, size, " (binary)");
+    else snprintf(buffer, size, " (+%d -%d)", file->added_lines, file->deleted_lines);
+}
+
+static void render_files(Section *section, MemoryContext *state_ctxt, bool is_staged, action_t *file_action, action_t *hunk_action,
+                         action_t *line_action) {
+    ASSERT(section != NULL && state_ctxt != NULL);
+
+    const FileVec *files = &section->files;
+    char stat[64];
 
     size_vec sorted_indexes = sort_files(files);
     for (size_t i = 0; i < sorted_indexes.length; i++) {
         File *file = &files->data[sorted_indexes.data[i]];
+        format_stat(file, stat, sizeof(stat));
+        // file can't be staged until it is updated
+        if (is_file_pending(file)) strncat(stat, " <pending>", sizeof(stat) - strlen(stat) - 1);
+        size_t recorded_count = journal_recorded_count(file, is_staged);
+        if (recorded_count > 0) {
+            size_t stat_length = strlen(stat);
+            snprintf(stat + stat_length, sizeof(stat) - stat_length, " <%zu recorded>", recorded_count);
+        }
 
         if (file->change_type == FC_DELETED) {
             // Don't display deleted files' content
-            VECTOR_PUSH(&hunk_indexes, lines.length);
-            ADD_LINE(file_action, file, LS_FILE, false, " deleted  %s", file->src);
+            CATEGORY_VECTOR_PUSH(MEM_UI, &hunk_indexes, lines.length);
+            ADD_LINE(file_action, file, LS_FILE, false, " deleted  %s%s", file->src, stat);
             continue;
         }
 
         switch (file->change_type) {
             case FC_MODIFIED:
-                ADD_LINE(file_action, file, LS_FILE, false, "%smodified %s", FOLD_CHAR(file->is_folded), file->src);
+                ADD_LINE(file_action, file, LS_FILE, false, "%smodified %s%s", FOLD_CHAR(file->is_folded), file->src, stat);
                 break;
             case FC_CREATED:
-                ADD_LINE(file_action, file, LS_FILE, false, "%screated  %s", FOLD_CHAR(file->is_folded), file->dst);
+                ADD_LINE(file_action, file, LS_FILE, false, "%screated  %s%s", FOLD_CHAR(file->is_folded), file->dst, stat);
                 break;
             case FC_RENAMED:
-                ADD_LINE(file_action, file, LS_FILE, false, "%srenamed  %s -> %s", FOLD_CHAR(file->is_folded), file->src, file->dst);
+                ADD_LINE(file_action, file, LS_FILE, false, "%srenamed  %s -> %s%s", FOLD_CHAR(file->is_folded), file->src, file->dst,
+                         stat);
                 break;
             default:
                 UNREACHABLE();
         }
 
-        if (file->is_folded || file->change_type == FC_CREATED) VECTOR_PUSH(&hunk_indexes, lines.length - 1);
+        if (file->is_folded || file->change_type == FC_CREATED) CATEGORY_VECTOR_PUSH(MEM_UI, &hunk_indexes, lines.length - 1);
 
         if (file->is_folded) continue;
+        if (file->is_summary) {
+            fetch_request(file, is_staged);
+            ADD_LINE(NULL, NULL, LS_LINE, false, "<loading diff>");
+            continue;
+        }
+        load_hunks(file, state_ctxt);
 
         if (file->old_mode != NULL && file->new_mode != NULL) {
             ASSERT(strcmp(file->old_mode, file->new_mode) != 0);
@@ -109,24 +155,28 @@ static void render_files(const FileVec *files, action_t *file_action, action_t *
             args->hunk = hunk;
             if (file->change_type != FC_CREATED) {
                 // Created files always have only one hunk, so there is no need to render it
-                VECTOR_PUSH(&hunk_indexes, lines.length);
-                ADD_LINE(hunk_action, args, LS_HUNK, false, "%s%s", FOLD_CHAR(hunk->is_folded), hunk->header);
+                CATEGORY_VECTOR_PUSH(MEM_UI, &hunk_indexes, lines.length);
+                ADD_LINE(hunk_action, args, LS_HUNK, false, "%s%.*s", FOLD_CHAR(hunk->is_folded),
+                         (int) HUNK_HEADER_LENGTH(file, hunk), HUNK_HEADER(file, hunk));
                 if (hunk->is_folded) continue;
             }
 
+            // recorded lines are only highlighted where they are, they move to the other section once the journal is applied
+            const bool *is_recorded = journal_recorded_lines(file, is_staged, i);
             LineStyle prev_style = LS_LINE;
             int hunk_y = lines.length;
-            for (size_t j = 0; j < hunk->lines.length; j++) {
-                const char *line = hunk->lines.data[j];
+            for (size_t j = 0; j < hunk->lines_count; j++) {
+                size_t length = HUNK_LINE_LENGTH(file, hunk, j);
 
                 // Hide empty last line
-                if (j == hunk->lines.length - 1 && strlen(line) == 1) break;
+                if (j == hunk->lines_count - 1 && length == 1) break;
 
-                char ch = line[0];
+                LineKind kind = HUNK_LINE_KIND(file, hunk, j);
                 LineStyle style = LS_LINE;
-                if (ch == '+') style = LS_ADD_LINE;
-                else if (ch == '-') style = LS_DEL_LINE;
-                else if (ch == NO_NEWLINE[0] && strcmp(line, NO_NEWLINE) == 0) style = prev_style;
+                if (kind == LK_ADD) style = LS_ADD_LINE;
+                else if (kind == LK_DEL) style = LS_DEL_LINE;
+                else if (kind == LK_NO_NEWLINE) style = prev_style;
+                if (is_recorded != NULL && is_recorded[j] && (kind == LK_ADD || kind == LK_DEL)) style = LS_RECORDED_LINE;
                 prev_style = style;
 
                 LineArgs *args = (LineArgs *) ctxt_alloc(&ctxt, sizeof(LineArgs));
@@ -135,17 +185,17 @@ static void render_files(const FileVec *files, action_t *file_action, action_t *
                 args->hunk_y = hunk_y;
                 args->line = j;
 
-                ADD_LINE(line_action, args, style, true, "%s", line);
+                add_text_line(line_action, args, style, true, HUNK_LINE(file, hunk, j), length);
             }
         }
-        if (!file->hunks.data[file->hunks.length - 1].is_folded) VECTOR_PUSH(&hunk_indexes, lines.length - 1);
+        if (!file->hunks.data[file->hunks.length - 1].is_folded) CATEGORY_VECTOR_PUSH(MEM_UI, &hunk_indexes, lines.length - 1);
     }
 
     VECTOR_FREE(&sorted_indexes);
 }
 
 void ui_init(void) {
-    ctxt_init(&ctxt);
+    ctxt_init(&ctxt, MEM_UI);
 
     setlocale(LC_ALL, "");
 
@@ -167,13 +217,14 @@ void ui_cleanup(void) {
     endwin();
 
     ctxt_free(&ctxt);
-    VECTOR_FREE(&lines);
-    VECTOR_FREE(&hunk_indexes);
+    CATEGORY_VECTOR_FREE(MEM_UI, &lines);
+    CATEGORY_VECTOR_FREE(MEM_UI, &hunk_indexes);
 }
 
 void render(State *state) {
     ASSERT(state != NULL);
 
+    render_count++;
     ctxt_reset(&ctxt);
     VECTOR_RESET(&lines);
     VECTOR_RESET(&hunk_indexes);
@@ -181,15 +232,24 @@ void render(State *state) {
     if (state->unstaged.files.length > 0) {
         ADD_LINE(&section_action, &state->unstaged, LS_SECTION, 0, "%sUnstaged changes:", FOLD_CHAR(state->unstaged.is_folded));
         if (!state->unstaged.is_folded)
-            render_files(&state->unstaged.files, &unstaged_file_action, &unstaged_hunk_action, &unstaged_line_action);
-        VECTOR_PUSH(&lines, EMPTY_LINE);
+            render_files(&state->unstaged, &state->ctxt, false, &unstaged_file_action, &unstaged_hunk_action, &unstaged_line_action);
+        CATEGORY_VECTOR_PUSH(MEM_UI, &lines, EMPTY_LINE);
     }
 
     if (state->staged.files.length > 0) {
         ADD_LINE(&section_action, &state->staged, LS_SECTION, 0, "%sStaged changes:", FOLD_CHAR(state->staged.is_folded));
-        if (!state->staged.is_folded) render_files(&state->staged.files, &staged_file_action, &staged_hunk_action, &staged_line_action);
-        VECTOR_PUSH(&lines, EMPTY_LINE);
+        if (!state->staged.is_folded)
+            render_files(&state->staged, &state->ctxt, true, &staged_file_action, &staged_hunk_action, &staged_line_action);
+        CATEGORY_VECTOR_PUSH(MEM_UI, &lines, EMPTY_LINE);
     }
+
+    if (!journal_is_empty()) ADD_LINE(NULL, NULL, LS_LINE, false, "<recorded changes are applied after a pause, press w to apply now>");
+
+    size_t pending = staging_pending();
+    if (pending > 0) ADD_LINE(NULL, NULL, LS_LINE, false, "<%zu pending staging operation%s>", pending, pending == 1 ? "" : "s");
+
+    const str_vec *errors = staging_errors();
+    for (size_t i = 0; i < errors->length; i++) ADD_LINE(NULL, NULL, LS_DEL_LINE, false, "%s", errors->data[i]);
 }
 
 int output(int scroll, int cursor, int selection_start, int selection_end) {
@@ -202,7 +262,7 @@ int output(int scroll, int cursor, int selection_start, int selection_end) {
 
         bool is_selected = i == cursor || (y >= selection_start && y <= selection_end);
         Line line = lines.data[scroll + i];
-        int length = strlen(line.str);
+        int length = line.length;
 
         attrset(line.style | (is_selected ? A_REVERSE : 0));
         bkgdset(line.style);
@@ -254,3 +314,4 @@ int get_next_hunk(int y) {
 
 int get_lines_length(void) { return lines.length; }
 bool is_selectable(int y) { return (size_t) y < lines.length && lines.data[y].is_selectable; }
+size_t get_render_count(void) { return render_count; }
@@ -33,7 +33,7 @@
 #define MOUSE_SCROLL_UP 1 << 19
 #endif
 
-typedef enum { LS_SECTION, LS_FILE, LS_HUNK, LS_LINE, LS_ADD_LINE, LS_DEL_LINE, __LS_SIZE } LineStyle;
+typedef enum { LS_SECTION, LS_FILE, LS_HUNK, LS_LINE, LS_ADD_LINE, LS_DEL_LINE, LS_RECORDED_LINE, __LS_SIZE } LineStyle;
 
 void ui_init(void);
 void ui_cleanup(void);
@@ -51,5 +51,7 @@ int get_next_hunk(int y);
 
 int get_lines_length(void);
 bool is_selectable(int y);
+// Returns number of renders so far, lines may have moved if it has changed
+size_t get_render_count(void);
 
 #endif  // UI_H
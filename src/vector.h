@@ -5,7 +5,10 @@
 #define VECTOR_H
 
 #include <stdlib.h>
+#include <string.h>
+#include "ctxt.h"
 #include "error.h"
+#include "memstat.h"
 
 #define INITIAL_VECTOR_CAPACITY 16
 
@@ -19,22 +22,44 @@
 // "Removes" all elements without changing capacity and changing memory
 #define VECTOR_RESET(vec) (vec)->length = 0;
 
-#define VECTOR_FREE(vec)     \
-    do {                     \
-        free((vec)->data);   \
-        (vec)->length = 0;   \
-        (vec)->capacity = 0; \
-        (vec)->data = NULL;  \
+// Vectors are accounted under MEM_VECTORS, CATEGORY_ variants account them under `category` instead.
+// Memory of a vector must be accounted under the same category by all of them.
+
+#define CATEGORY_VECTOR_FREE(category, vec)                                \
+    do {                                                                   \
+        mem_unaccount((category), (vec)->capacity * sizeof(*(vec)->data)); \
+        free((vec)->data);                                                 \
+        (vec)->length = 0;                                                 \
+        (vec)->capacity = 0;                                               \
+        (vec)->data = NULL;                                                \
     } while (0);
 
-#define VECTOR_PUSH(vec, element)                                                       \
+#define VECTOR_FREE(vec) CATEGORY_VECTOR_FREE(MEM_VECTORS, vec)
+
+// Makes sure that vector can hold `new_capacity` elements without reallocating
+#define CATEGORY_VECTOR_RESERVE(category, vec, new_capacity)                                    \
+    do {                                                                                        \
+        ASSERT((vec) != NULL);                                                                  \
+        if ((new_capacity) > (vec)->capacity) {                                                 \
+            mem_account((category), ((new_capacity) - (vec)->capacity) * sizeof(*(vec)->data)); \
+            (vec)->capacity = (new_capacity);                                                   \
+            (vec)->data = realloc((vec)->data, (vec)->capacity * sizeof(*(vec)->data));         \
+            if ((vec)->data == NULL) OUT_OF_MEMORY();                                           \
+        }                                                                                       \
+    } while (0)
+
+#define VECTOR_RESERVE(vec, new_capacity) CATEGORY_VECTOR_RESERVE(MEM_VECTORS, vec, new_capacity)
+
+#define CATEGORY_VECTOR_PUSH(category, vec, element)                                    \
     do {                                                                                \
         ASSERT((vec) != NULL);                                                          \
         if ((vec)->capacity == 0) {                                                     \
+            mem_account((category), INITIAL_VECTOR_CAPACITY * sizeof(*(vec)->data));    \
             (vec)->capacity = INITIAL_VECTOR_CAPACITY;                                  \
             (vec)->data = malloc((vec)->capacity * sizeof(*(vec)->data));               \
             if ((vec)->data == NULL) OUT_OF_MEMORY();                                   \
         } else if ((vec)->length == (vec)->capacity) {                                  \
+            mem_account((category), (vec)->capacity * sizeof(*(vec)->data));            \
             (vec)->capacity *= 2;                                                       \
             (vec)->data = realloc((vec)->data, (vec)->capacity * sizeof(*(vec)->data)); \
             if ((vec)->data == NULL) OUT_OF_MEMORY();                                   \
@@ -42,6 +67,30 @@
         (vec)->data[(vec)->length++] = (element);                                       \
     } while (0)
 
+#define VECTOR_PUSH(vec, element) CATEGORY_VECTOR_PUSH(MEM_VECTORS, vec, element)
+
+// Same as VECTOR_RESERVE and VECTOR_PUSH, but data is allocated from `ctxt`. Old data is
+// left in the context until it is freed, so the vector must not be freed with VECTOR_FREE.
+#define CTXT_VECTOR_RESERVE(ctxt, vec, new_capacity)                                                    \
+    do {                                                                                                \
+        ASSERT((vec) != NULL);                                                                          \
+        if ((new_capacity) > (vec)->capacity) {                                                         \
+            void *new_data = ctxt_alloc((ctxt), (new_capacity) * sizeof(*(vec)->data));                 \
+            if ((vec)->length > 0) memcpy(new_data, (vec)->data, (vec)->length * sizeof(*(vec)->data)); \
+            (vec)->data = new_data;                                                                     \
+            (vec)->capacity = (new_capacity);                                                           \
+        }                                                                                               \
+    } while (0)
+
+#define CTXT_VECTOR_PUSH(ctxt, vec, element)                                                                          \
+    do {                                                                                                              \
+        ASSERT((vec) != NULL);                                                                                        \
+        if ((vec)->length == (vec)->capacity) {                                                                       \
+            CTXT_VECTOR_RESERVE((ctxt), (vec), (vec)->capacity == 0 ? INITIAL_VECTOR_CAPACITY : (vec)->capacity * 2); \
+        }                                                                                                             \
+        (vec)->data[(vec)->length++] = (element);                                                                     \
+    } while (0)
+
 VECTOR_TYPEDEF(str_vec, char *);
 VECTOR_TYPEDEF(size_vec, size_t);
 VECTOR_TYPEDEF(int_vec, int);